@@ -2,18 +2,64 @@
 	Chinese chess game implemented in C++11 with a lot of template techniques.
 */
 #include <iostream>
+#include <cstdint>
+#include <cassert>
+#include <cstdlib>
+#include <cctype>
+#include <cstring>
 #include <array>
-#include <stack>
+#include <deque>
+#include <unordered_map>
 #include <vector>
 #include <algorithm>
 #include <numeric>
 #include <string>
+#include <sstream>
 #include <regex>
-#include <future>
 #include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 #include <utility>
 #include <type_traits>
 
+#include <memory>
+#include <new>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <cmath>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <xmmintrin.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define GCHESS_X86 1
+#include <immintrin.h>
+#else
+#define GCHESS_X86 0
+#endif
+
+// Compiles one function for a newer instruction set than the rest of the file, it must only run after a CPU check.
+#if defined(__GNUC__)
+#define GCHESS_TARGET(arch) __attribute__((target(arch)))
+#else
+#define GCHESS_TARGET(arch)
+#endif
+
+#if defined(_WIN32)
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 namespace g_chess {
 	enum class Side {
 		UP, DOWN, EXTRA
@@ -70,27 +116,422 @@ namespace g_chess {
 		bool operator!=(const Pos& other) const noexcept { return !(*this == other); }
 	};
 
+	/*
+		A move packed in 16 bits, the from square in the high byte and the to square in the low byte.
+		Squares are Board::toSquare indices of the padded board, a zero move is never a legal one.
+	*/
 	struct Move {
-		Pos from, to;
+		uint16_t data;
 
 		Move() = default;
-		Move(const Pos& _from, const Pos& _to) : from(_from), to(_to) {}
-		bool operator==(const Move& other) const noexcept { return from == other.from && to == other.to; }
+		Move(uint32_t fromSq, uint32_t toSq) : data(static_cast<uint16_t>((fromSq << 8) | toSq)) {}
+		Move(const Pos& _from, const Pos& _to);
+
+		uint32_t from() const noexcept { return data >> 8; }
+		uint32_t to() const noexcept { return data & 0xFF; }
+		Pos fromPos() const noexcept;
+		Pos toPos() const noexcept;
+
+		bool operator==(const Move& other) const noexcept { return data == other.data; }
 		bool operator!=(const Move& other) const noexcept { return !(*this == other); }
 	};
 
-	using Moves = std::vector<Move>;
+	/*
+		Fixed-capacity move list that lives on the stack, so generating moves never allocates.
+		With at most the starting material, which setFen enforces, a side has at most 120 pseudo-legal moves:
+		2 * 17 chariot, 2 * 17 cannon, 2 * 8 horse, 2 * 4 elephant, 2 * 4 advisor, 5 * 3 soldier and 4 + 1 general
+		moves, the last one capturing a facing general.
+	*/
+	class MoveList {
+	public:
+		constexpr static uint32_t MAX_MOVES = 128;
+	private:
+		std::array<Move, MAX_MOVES> moves;
+		uint32_t count;
+	public:
+		MoveList() : count(0) {}
+
+		template<typename ... Args>
+		void emplace_back(Args&& ... args) {
+			assert(count < MAX_MOVES);
+			moves[count++] = Move(std::forward<Args>(args)...);
+		}
+
+		void push_back(const Move& m) {
+			assert(count < MAX_MOVES);
+			moves[count++] = m;
+		}
+		void clear() noexcept { count = 0; }
+
+		Move* begin() noexcept { return moves.data(); }
+		Move* end() noexcept { return moves.data() + count; }
+		const Move* begin() const noexcept { return moves.data(); }
+		const Move* end() const noexcept { return moves.data() + count; }
+		const Move* cbegin() const noexcept { return begin(); }
+		const Move* cend() const noexcept { return end(); }
+
+		size_t size() const noexcept { return count; }
+		bool empty() const noexcept { return count == 0; }
+		Move& front() noexcept { return moves[0]; }
+		const Move& front() const noexcept { return moves[0]; }
+		Move& operator[](size_t i) noexcept { return moves[i]; }
+		const Move& operator[](size_t i) const noexcept { return moves[i]; }
+	};
+
+	using Moves = MoveList;
 
+	// A null move has from == to.
 	struct HistoryNode {
-		Pos from, to;
+		uint8_t from, to;
 		Piece fromP, toP;
+		uint8_t toSlot;
+		uint16_t reversiblePlies;
 
 		HistoryNode() = default;
-		HistoryNode(const Pos& _from, const Pos& _to, const Piece& _fromP, const Piece& _toP)
-			: from(_from), to(_to), fromP(_fromP), toP(_toP)
+		HistoryNode(uint32_t _from, uint32_t _to, const Piece& _fromP, const Piece& _toP, uint32_t _toSlot, uint32_t _reversiblePlies)
+			: from(static_cast<uint8_t>(_from)), to(static_cast<uint8_t>(_to)), fromP(_fromP), toP(_toP), toSlot(static_cast<uint8_t>(_toSlot)),
+			reversiblePlies(static_cast<uint16_t>(std::min(_reversiblePlies, 0xFFFFu)))
 		{}
 	};
 
+	/*
+		Optional NNUE evaluator. The input is one feature per (piece, square), seen from each side: pieces are
+		relative to the perspective (own 0-6, enemy 7-13 in Type order) and the board is turned 180 degrees for UP,
+		so both sides see their own pieces at the bottom. Each perspective has a HIDDEN_SIZE int16 accumulator, the
+		sum of the first layer weight rows of all pieces, which move()/undo() keep up to date by adding and
+		subtracting rows. The output is a single int8 layer on the clipped accumulators, side to move first.
+
+		Network file, little endian:
+			char[4] "GCNN", uint32 version (1), uint32 hidden size (HIDDEN_SIZE)
+			int16 featureBias[HIDDEN_SIZE]
+			int16 featureWeights[FEATURE_NUM][HIDDEN_SIZE]
+			int8 outputWeights[2 * HIDDEN_SIZE]
+			int32 outputBias
+		The evaluation is (sum(clamp(acc, 0, CLIP) * outputWeights) + outputBias) / OUTPUT_DIVISOR.
+
+		The kernels come in AVX2, SSE4.1 and scalar versions, the best one the CPU supports is picked at startup.
+	*/
+	namespace nnue {
+		constexpr uint32_t SQUARE_NUM = 90;
+		constexpr uint32_t FEATURE_NUM = 14 * SQUARE_NUM;
+		constexpr uint32_t HIDDEN_SIZE = 256;
+		constexpr int16_t CLIP = 127;
+		constexpr int32_t OUTPUT_DIVISOR = 1024;
+		constexpr uint32_t FILE_VERSION = 1;
+
+		struct Accumulator {
+			// Indexed by Side, UP then DOWN.
+			std::array<std::array<int16_t, HIDDEN_SIZE>, 2> values;
+		};
+
+		namespace kernel {
+			inline void addScalar(int16_t* acc, const int16_t* row) {
+				for (uint32_t i = 0; i < HIDDEN_SIZE; ++i) {
+					acc[i] = static_cast<int16_t>(acc[i] + row[i]);
+				}
+			}
+
+			inline void subScalar(int16_t* acc, const int16_t* row) {
+				for (uint32_t i = 0; i < HIDDEN_SIZE; ++i) {
+					acc[i] = static_cast<int16_t>(acc[i] - row[i]);
+				}
+			}
+
+			inline void addSubScalar(int16_t* acc, const int16_t* addRow, const int16_t* subRow) {
+				for (uint32_t i = 0; i < HIDDEN_SIZE; ++i) {
+					acc[i] = static_cast<int16_t>(acc[i] + addRow[i] - subRow[i]);
+				}
+			}
+
+			inline int32_t outputScalar(const int16_t* us, const int16_t* them, const int8_t* weights) {
+				int32_t sum = 0;
+				for (uint32_t i = 0; i < HIDDEN_SIZE; ++i) {
+					sum += std::min(std::max(us[i], static_cast<int16_t>(0)), CLIP) * weights[i];
+					sum += std::min(std::max(them[i], static_cast<int16_t>(0)), CLIP) * weights[HIDDEN_SIZE + i];
+				}
+
+				return sum;
+			}
+
+#if GCHESS_X86
+			GCHESS_TARGET("sse4.1") inline void addSse41(int16_t* acc, const int16_t* row) {
+				for (uint32_t i = 0; i < HIDDEN_SIZE; i += 8) {
+					__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + i));
+					__m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(acc + i), _mm_add_epi16(a, r));
+				}
+			}
+
+			GCHESS_TARGET("sse4.1") inline void subSse41(int16_t* acc, const int16_t* row) {
+				for (uint32_t i = 0; i < HIDDEN_SIZE; i += 8) {
+					__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + i));
+					__m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(acc + i), _mm_sub_epi16(a, r));
+				}
+			}
+
+			GCHESS_TARGET("sse4.1") inline void addSubSse41(int16_t* acc, const int16_t* addRow, const int16_t* subRow) {
+				for (uint32_t i = 0; i < HIDDEN_SIZE; i += 8) {
+					__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + i));
+					__m128i add = _mm_loadu_si128(reinterpret_cast<const __m128i*>(addRow + i));
+					__m128i sub = _mm_loadu_si128(reinterpret_cast<const __m128i*>(subRow + i));
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(acc + i), _mm_sub_epi16(_mm_add_epi16(a, add), sub));
+				}
+			}
+
+			GCHESS_TARGET("sse4.1") inline int32_t outputSse41(const int16_t* us, const int16_t* them, const int8_t* weights) {
+				const __m128i zero = _mm_setzero_si128();
+				const __m128i clip = _mm_set1_epi16(CLIP);
+				__m128i sum = _mm_setzero_si128();
+
+				for (uint32_t half = 0; half < 2; ++half) {
+					const int16_t* acc = half == 0 ? us : them;
+					const int8_t* w = weights + half * HIDDEN_SIZE;
+
+					for (uint32_t i = 0; i < HIDDEN_SIZE; i += 8) {
+						__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + i));
+						a = _mm_min_epi16(_mm_max_epi16(a, zero), clip);
+						__m128i ws = _mm_cvtepi8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(w + i)));
+						sum = _mm_add_epi32(sum, _mm_madd_epi16(a, ws));
+					}
+				}
+
+				sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+				sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+				return _mm_cvtsi128_si32(sum);
+			}
+
+			GCHESS_TARGET("avx2") inline void addAvx2(int16_t* acc, const int16_t* row) {
+				for (uint32_t i = 0; i < HIDDEN_SIZE; i += 16) {
+					__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc + i));
+					__m256i r = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i));
+					_mm256_storeu_si256(reinterpret_cast<__m256i*>(acc + i), _mm256_add_epi16(a, r));
+				}
+			}
+
+			GCHESS_TARGET("avx2") inline void subAvx2(int16_t* acc, const int16_t* row) {
+				for (uint32_t i = 0; i < HIDDEN_SIZE; i += 16) {
+					__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc + i));
+					__m256i r = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i));
+					_mm256_storeu_si256(reinterpret_cast<__m256i*>(acc + i), _mm256_sub_epi16(a, r));
+				}
+			}
+
+			GCHESS_TARGET("avx2") inline void addSubAvx2(int16_t* acc, const int16_t* addRow, const int16_t* subRow) {
+				for (uint32_t i = 0; i < HIDDEN_SIZE; i += 16) {
+					__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc + i));
+					__m256i add = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(addRow + i));
+					__m256i sub = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(subRow + i));
+					_mm256_storeu_si256(reinterpret_cast<__m256i*>(acc + i), _mm256_sub_epi16(_mm256_add_epi16(a, add), sub));
+				}
+			}
+
+			GCHESS_TARGET("avx2") inline int32_t outputAvx2(const int16_t* us, const int16_t* them, const int8_t* weights) {
+				const __m256i zero = _mm256_setzero_si256();
+				const __m256i clip = _mm256_set1_epi16(CLIP);
+				__m256i sum = _mm256_setzero_si256();
+
+				for (uint32_t half = 0; half < 2; ++half) {
+					const int16_t* acc = half == 0 ? us : them;
+					const int8_t* w = weights + half * HIDDEN_SIZE;
+
+					for (uint32_t i = 0; i < HIDDEN_SIZE; i += 16) {
+						__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc + i));
+						a = _mm256_min_epi16(_mm256_max_epi16(a, zero), clip);
+						__m256i ws = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(w + i)));
+						sum = _mm256_add_epi32(sum, _mm256_madd_epi16(a, ws));
+					}
+				}
+
+				__m128i s = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+				s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+				s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+				return _mm_cvtsi128_si32(s);
+			}
+#endif
+
+			enum class Level {
+				SCALAR, SSE41, AVX2
+			};
+
+			inline Level detectLevel() {
+#if GCHESS_X86 && defined(__GNUC__)
+				__builtin_cpu_init();
+				if (__builtin_cpu_supports("avx2")) {
+					return Level::AVX2;
+				}
+				if (__builtin_cpu_supports("sse4.1")) {
+					return Level::SSE41;
+				}
+#elif GCHESS_X86 && defined(_MSC_VER)
+				int info[4];
+				__cpuid(info, 0);
+				const int maxLeaf = info[0];
+
+				__cpuid(info, 1);
+				const bool sse41 = (info[2] & (1 << 19)) != 0;
+				const bool osAvx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+
+				if (maxLeaf >= 7 && osAvx) {
+					__cpuidex(info, 7, 0);
+					if ((info[1] & (1 << 5)) != 0) {
+						return Level::AVX2;
+					}
+				}
+				if (sse41) {
+					return Level::SSE41;
+				}
+#endif
+				return Level::SCALAR;
+			}
+
+			struct Kernels {
+				Level level;
+				void (*add)(int16_t*, const int16_t*);
+				void (*sub)(int16_t*, const int16_t*);
+				void (*addSub)(int16_t*, const int16_t*, const int16_t*);
+				int32_t (*output)(const int16_t*, const int16_t*, const int8_t*);
+			};
+
+			inline Kernels selectKernels(Level level) {
+#if GCHESS_X86
+				if (level == Level::AVX2) {
+					return Kernels{ level, addAvx2, subAvx2, addSubAvx2, outputAvx2 };
+				}
+				if (level == Level::SSE41) {
+					return Kernels{ level, addSse41, subSse41, addSubSse41, outputSse41 };
+				}
+#endif
+				return Kernels{ Level::SCALAR, addScalar, subScalar, addSubScalar, outputScalar };
+			}
+
+			inline const char* levelName(Level level) {
+				return level == Level::AVX2 ? "avx2" : level == Level::SSE41 ? "sse4.1" : "scalar";
+			}
+
+			const Kernels kernels = selectKernels(detectLevel());
+		};
+
+		// Feature of piece p on square sq (rank * 9 + file, rank 0 at UP's side) as seen by perspective.
+		inline uint32_t featureOf(Side perspective, Piece p, uint32_t sq) noexcept {
+			uint32_t relativePiece = static_cast<uint32_t>(p_util::getType(p)) + (p_util::getSide(p) == perspective ? 0 : 7);
+			uint32_t relativeSq = perspective == Side::DOWN ? sq : SQUARE_NUM - 1 - sq;
+			return relativePiece * SQUARE_NUM + relativeSq;
+		}
+
+		class Network {
+		private:
+			std::vector<int16_t> featureBias;
+			std::vector<int16_t> featureWeights;
+			std::vector<int8_t> outputWeights;
+			int32_t outputBias;
+		private:
+			const int16_t* rowOf(Side perspective, Piece p, uint32_t sq) const noexcept {
+				return featureWeights.data() + static_cast<size_t>(featureOf(perspective, p, sq)) * HIDDEN_SIZE;
+			}
+
+			template<typename T>
+			static bool readArray(std::istream& in, std::vector<T>& values, size_t size) {
+				values.resize(size);
+				in.read(reinterpret_cast<char*>(values.data()), static_cast<std::streamsize>(size * sizeof(T)));
+				return static_cast<bool>(in);
+			}
+		public:
+			Network() : featureBias(HIDDEN_SIZE), featureWeights(static_cast<size_t>(FEATURE_NUM) * HIDDEN_SIZE), outputWeights(2 * HIDDEN_SIZE), outputBias(0) {}
+
+			// Reads a network file in the format above, returns false and leaves the network unchanged on any error.
+			bool load(const std::string& path) {
+				std::ifstream in{ path, std::ios::binary };
+				char magic[4] = {};
+				uint32_t header[2] = {};
+				Network loaded;
+
+				in.read(magic, sizeof(magic));
+				in.read(reinterpret_cast<char*>(header), sizeof(header));
+				if (!in || std::string(magic, sizeof(magic)) != "GCNN" || header[0] != FILE_VERSION || header[1] != HIDDEN_SIZE) {
+					return false;
+				}
+
+				if (!readArray(in, loaded.featureBias, HIDDEN_SIZE)
+					|| !readArray(in, loaded.featureWeights, static_cast<size_t>(FEATURE_NUM) * HIDDEN_SIZE)
+					|| !readArray(in, loaded.outputWeights, 2 * HIDDEN_SIZE)) {
+					return false;
+				}
+
+				in.read(reinterpret_cast<char*>(&loaded.outputBias), sizeof(loaded.outputBias));
+				if (!in) {
+					return false;
+				}
+
+				*this = std::move(loaded);
+				return true;
+			}
+
+			bool save(const std::string& path) const {
+				std::ofstream out{ path, std::ios::binary };
+				const uint32_t header[2] = { FILE_VERSION, HIDDEN_SIZE };
+
+				out.write("GCNN", 4);
+				out.write(reinterpret_cast<const char*>(header), sizeof(header));
+				out.write(reinterpret_cast<const char*>(featureBias.data()), static_cast<std::streamsize>(featureBias.size() * sizeof(int16_t)));
+				out.write(reinterpret_cast<const char*>(featureWeights.data()), static_cast<std::streamsize>(featureWeights.size() * sizeof(int16_t)));
+				out.write(reinterpret_cast<const char*>(outputWeights.data()), static_cast<std::streamsize>(outputWeights.size()));
+				out.write(reinterpret_cast<const char*>(&outputBias), sizeof(outputBias));
+
+				return static_cast<bool>(out);
+			}
+
+			// Raw access for tools that build or train a network.
+			std::vector<int16_t>& getFeatureBias() noexcept { return featureBias; }
+			std::vector<int16_t>& getFeatureWeights() noexcept { return featureWeights; }
+			std::vector<int8_t>& getOutputWeights() noexcept { return outputWeights; }
+			void setOutputBias(int32_t bias) noexcept { outputBias = bias; }
+
+			void reset(Accumulator& acc) const {
+				for (auto& values : acc.values) {
+					std::copy(featureBias.begin(), featureBias.end(), values.begin());
+				}
+			}
+
+			void addPiece(Accumulator& acc, Piece p, uint32_t sq) const {
+				for (Side perspective : { Side::UP, Side::DOWN }) {
+					kernel::kernels.add(acc.values[static_cast<uint32_t>(perspective)].data(), rowOf(perspective, p, sq));
+				}
+			}
+
+			void removePiece(Accumulator& acc, Piece p, uint32_t sq) const {
+				for (Side perspective : { Side::UP, Side::DOWN }) {
+					kernel::kernels.sub(acc.values[static_cast<uint32_t>(perspective)].data(), rowOf(perspective, p, sq));
+				}
+			}
+
+			void movePiece(Accumulator& acc, Piece p, uint32_t fromSq, uint32_t toSq) const {
+				for (Side perspective : { Side::UP, Side::DOWN }) {
+					kernel::kernels.addSub(acc.values[static_cast<uint32_t>(perspective)].data(), rowOf(perspective, p, toSq), rowOf(perspective, p, fromSq));
+				}
+			}
+
+			// Score for the side to move.
+			int32_t evaluate(const Accumulator& acc, Side sideToMove) const {
+				const int16_t* us = acc.values[static_cast<uint32_t>(sideToMove)].data();
+				const int16_t* them = acc.values[static_cast<uint32_t>(p_util::getReverseSide(sideToMove))].data();
+
+				return (kernel::kernels.output(us, them, outputWeights.data()) + outputBias) / OUTPUT_DIVISOR;
+			}
+		};
+	};
+
+	namespace zobrist {
+		inline uint64_t getPieceKey(Piece p, uint32_t sq) noexcept;
+		inline uint64_t getSideKey() noexcept;
+	};
+
+	inline int32_t getPieceValue(Piece p);
+	inline int32_t getPiecePosValue(Piece p, const Pos& pos);
+
+	class TransTable;
+	inline void prefetchTT(const TransTable* tt, uint64_t key) noexcept;
+
 	class Board {
 	public:
 		constexpr static uint32_t COL_NUM = 9;
@@ -115,20 +556,123 @@ namespace g_chess {
 		constexpr static uint32_t LINE_UP_9_LEFT = COL_BEGIN + 3;
 		constexpr static uint32_t LINE_UP_9_RIGHT = COL_BEGIN + 5;
 
-		constexpr static uint32_t LINE_DOWN_9_TOP = ROW_END - 2;
-		constexpr static uint32_t LINE_DOWN_9_BOTTOM = ROW_END;
+		constexpr static uint32_t LINE_DOWN_9_TOP = ROW_END - 3;
+		constexpr static uint32_t LINE_DOWN_9_BOTTOM = ROW_END - 1;
 		constexpr static uint32_t LINE_DOWN_9_LEFT = COL_BEGIN + 3;
 		constexpr static uint32_t LINE_DOWN_9_RIGHT = COL_BEGIN + 5;
+
+		constexpr static uint32_t SQUARE_NUM = ACTUAL_ROW_NUM * ACTUAL_COL_NUM;
+		constexpr static uint32_t MAX_PIECE_NUM = 16;
+		// A padding square, used as the general square of a side whose general was captured.
+		constexpr static uint32_t NO_SQUARE = 0;
 	private:
-		std::array<std::array<Piece, ACTUAL_COL_NUM>, ACTUAL_ROW_NUM> data;
-		std::stack<HistoryNode> history;
+		std::array<Piece, SQUARE_NUM> data;
+		std::vector<HistoryNode> history;
+		uint64_t key;
+		int32_t score;
+
+		/*
+			keys[i] is the key of the position history[i] was played in, the whole game and the search path in one array
+			so a repetition check is a strided scan. reversiblePlies counts the moves since the last capture or null
+			move, no position from before either can come again.
+		*/
+		std::vector<uint64_t> keys;
+		uint32_t reversiblePlies;
+
+		/*
+			Piece lists, the squares of the live pieces of each side, packed in the first pieceCount[side] slots.
+			pieceSlot maps an occupied square back to its slot, so a capture is a swap with the last slot.
+		*/
+		std::array<std::array<uint8_t, MAX_PIECE_NUM>, 2> pieceSquares;
+		std::array<uint32_t, 2> pieceCount;
+		std::array<uint8_t, SQUARE_NUM> pieceSlot;
+		std::array<uint32_t, 2> generalSquares;
+
+		// Table to prefetch the child position's bucket from, set while a search runs on this board.
+		const TransTable* prefetchTable;
+
+		// Optional NNUE evaluator, its accumulator follows every move()/undo() while one is set.
+		const nnue::Network* network;
+		nnue::Accumulator accumulator;
 	private:
-		void set(const Pos& pos, Piece p) {
-			data[pos.row][pos.col] = p;
+		void set(uint32_t sq, Piece p) {
+			data[sq] = p;
+		}
+
+		uint64_t calcKey() const noexcept {
+			uint64_t k = 0;
+
+			for (uint32_t r = ROW_BEGIN; r < ROW_END; ++r) {
+				for (uint32_t c = COL_BEGIN; c < COL_END; ++c) {
+					k ^= zobrist::getPieceKey(get(r, c), toSquare(r, c));
+				}
+			}
+
+			return k;
+		}
+
+		void initPieceLists() noexcept {
+			pieceCount.fill(0);
+			pieceSlot.fill(0);
+			generalSquares.fill(NO_SQUARE);
+
+			for (uint32_t r = ROW_BEGIN; r < ROW_END; ++r) {
+				for (uint32_t c = COL_BEGIN; c < COL_END; ++c) {
+					Piece p = get(r, c);
+
+					if (p != Piece::EE) {
+						addToPieceList(p_util::getSide(p), toSquare(r, c));
+					}
+
+					if (p_util::getType(p) == Type::GENERAL) {
+						generalSquares[static_cast<uint32_t>(p_util::getSide(p))] = toSquare(r, c);
+					}
+				}
+			}
+		}
+
+		void addToPieceList(Side side, uint32_t sq) noexcept {
+			uint32_t s = static_cast<uint32_t>(side);
+			pieceSlot[sq] = static_cast<uint8_t>(pieceCount[s]);
+			pieceSquares[s][pieceCount[s]++] = static_cast<uint8_t>(sq);
+		}
+
+		void removeFromPieceList(Side side, uint32_t sq) noexcept {
+			uint32_t s = static_cast<uint32_t>(side);
+			uint32_t slot = pieceSlot[sq];
+			uint32_t lastSq = pieceSquares[s][--pieceCount[s]];
+
+			pieceSquares[s][slot] = static_cast<uint8_t>(lastSq);
+			pieceSlot[lastSq] = static_cast<uint8_t>(slot);
+		}
+
+		// Undoes removeFromPieceList exactly, so the list order and with it the move generation order never drift.
+		void restoreToPieceList(Side side, uint32_t sq, uint32_t slot) noexcept {
+			uint32_t s = static_cast<uint32_t>(side);
+			uint32_t movedSq = pieceSquares[s][slot];
+
+			pieceSquares[s][pieceCount[s]] = static_cast<uint8_t>(movedSq);
+			pieceSlot[movedSq] = static_cast<uint8_t>(pieceCount[s]++);
+			pieceSquares[s][slot] = static_cast<uint8_t>(sq);
+			pieceSlot[sq] = static_cast<uint8_t>(slot);
+		}
+
+		void relocateInPieceList(Side side, uint32_t fromSq, uint32_t toSq) noexcept {
+			uint32_t slot = pieceSlot[fromSq];
+
+			pieceSquares[static_cast<uint32_t>(side)][slot] = static_cast<uint8_t>(toSq);
+			pieceSlot[toSq] = static_cast<uint8_t>(slot);
+		}
+
+		static int32_t scoreOf(Piece p, const Pos& pos) {
+			return getPieceValue(p) + getPiecePosValue(p, pos);
+		}
+
+		static int32_t scoreOf(Piece p, uint32_t sq) {
+			return scoreOf(p, toPos(sq));
 		}
 	public:
 		Board() :
-			history{},
 			data{
 				Piece::EO,Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO,Piece::EO,
 				Piece::EO,Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO,Piece::EO,
@@ -144,427 +688,1634 @@ namespace g_chess {
 				Piece::EO,Piece::EO, Piece::DR, Piece::DN, Piece::DB, Piece::DA, Piece::DG, Piece::DA, Piece::DB, Piece::DN, Piece::DR, Piece::EO,Piece::EO,
 				Piece::EO,Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO,Piece::EO,
 				Piece::EO,Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO, Piece::EO,Piece::EO,
-			}
-		{}
+			},
+			history{},
+			key{ 0 },
+			score{ 0 },
+			keys{},
+			reversiblePlies(0),
+			pieceSquares{},
+			pieceCount{},
+			pieceSlot{},
+			generalSquares{},
+			prefetchTable(nullptr),
+			network(nullptr),
+			accumulator{}
+		{
+			initPieceLists();
+			key = calcKey();
+			score = calcScore();
+		}
 
-		Piece get(uint32_t row, uint32_t col) const {
-			return data[row][col];
+		constexpr static uint32_t toSquare(uint32_t row, uint32_t col) noexcept {
+			return row * ACTUAL_COL_NUM + col;
 		}
 
-		Piece get(const Pos& pos) const {
-			return get(pos.row, pos.col);
+		constexpr static uint32_t toSquare(const Pos& pos) noexcept {
+			return toSquare(pos.row, pos.col);
 		}
 
-		void move(const Move& m) {
-			history.emplace(m.from, m.to, get(m.from), get(m.to));
+		static Pos toPos(uint32_t sq) noexcept {
+			return Pos{ sq / ACTUAL_COL_NUM, sq % ACTUAL_COL_NUM };
+		}
 
-			set(m.to, get(m.from));
-			set(m.from, Piece::EE);
+		Piece get(uint32_t row, uint32_t col) const {
+			return data[toSquare(row, col)];
 		}
 
-		void undo() {
-			if (history.empty()) {
-				return;
-			}
+		Piece get(const Pos& pos) const {
+			return data[toSquare(pos)];
+		}
 
-			const auto& historyNode = history.top();
+		Piece get(uint32_t sq) const {
+			return data[sq];
+		}
 
-			set(historyNode.from, historyNode.fromP);
-			set(historyNode.to, historyNode.toP);
-			history.pop();
+		uint32_t getPieceCount(Side side) const noexcept {
+			return pieceCount[static_cast<uint32_t>(side)];
 		}
-	};
 
-	void printBoard(const Board& bd) {
-		Piece p;
-		uint32_t n = Board::ROW_NUM - 1;
+		uint32_t getPieceSquare(Side side, uint32_t slot) const noexcept {
+			return pieceSquares[static_cast<uint32_t>(side)][slot];
+		}
 
-		std::cout << "\n";
-		for (uint32_t r = Board::ROW_BEGIN; r < Board::ROW_END; ++r) {
-			if (r == (Board::ROW_BEGIN + Board::ROW_END) / 2) {
-				std::cout << "  | =================\n";
-				std::cout << "  | =================\n";
-			}
+		// Square numbering of the bitboard backend and of the NNUE features, rank * 9 + file over the real squares.
+		static uint32_t toSquare90(uint32_t sq) noexcept {
+			return (sq / ACTUAL_COL_NUM - ROW_BEGIN) * COL_NUM + sq % ACTUAL_COL_NUM - COL_BEGIN;
+		}
 
-			std::cout << n-- << " | ";
-			for (uint32_t c = Board::COL_BEGIN; c < Board::COL_END; ++c) {
-				p = bd.get(r, c);
-				std::cout << p_util::getChar(p) << " ";
-			}
+		void setNetwork(const nnue::Network* net) {
+			network = net;
+			refreshAccumulator();
+		}
 
-			std::cout << "\n";
+		const nnue::Network* getNetwork() const noexcept {
+			return network;
 		}
 
-		std::cout << "  +------------------\n";
-		std::cout << "\n    a b c d e f g h i\n\n";
-	}
+		const nnue::Accumulator& getAccumulator() const noexcept {
+			return accumulator;
+		}
 
-	namespace gen_moves {
-		template<Type T>
-		void addMoveOf(Side side, const Board& bd, Moves& moves, const Pos& from, const Pos& to) {}
+		// Recomputes the accumulator from scratch, move()/undo() only ever update it.
+		void refreshAccumulator() {
+			if (network == nullptr) {
+				return;
+			}
 
-		template<Type T>
-		void addMoveOf(Side side, const Board& bd, Moves& moves, const Pos& from, int32_t rowVariation, int32_t colVariation) {}
+			network->reset(accumulator);
+			for (Side side : { Side::UP, Side::DOWN }) {
+				for (uint32_t i = 0; i < getPieceCount(side); ++i) {
+					uint32_t sq = getPieceSquare(side, i);
+					network->addPiece(accumulator, get(sq), toSquare90(sq));
+				}
+			}
+		}
 
-		template<Type T>
-		void addMoveOf(Side side, const Board& bd, Moves& moves, const Pos& from, const Pos& to, const Pos& middle) {}
+		void setPrefetchTable(const TransTable* tt) noexcept {
+			prefetchTable = tt;
+		}
 
-		template<>
-		void addMoveOf<Type::PAWN>(Side side, const Board& bd, Moves& moves, const Pos& from, const Pos& to) {
-			Piece p = bd.get(to);
+		uint32_t getGeneralSquare(Side side) const noexcept {
+			return generalSquares[static_cast<uint32_t>(side)];
+		}
 
-			if (p != Piece::EO && p_util::getSide(p) != side) {
-				moves.emplace_back(from, to);
-			}
+		/*
+			Zobrist key of the current position, the side to move is folded in by toggling the side key on every move.
+		*/
+		uint64_t getKey() const noexcept {
+			return key;
 		}
 
-		template<>
-		void addMoveOf<Type::CANNON>(Side side, const Board& bd, Moves& moves, const Pos& from, int32_t rowVariation, int32_t colVariation) {
-			uint32_t newRow = from.row + rowVariation;
-			uint32_t newCol = from.col + colVariation;
-			Piece p = bd.get(newRow, newCol);
+		/*
+			Material + piece-square score, kept up to date by move()/undo() so the leaf evaluation doesn't scan the board.
+		*/
+		int32_t getScore() const noexcept {
+			return score;
+		}
 
-			while (p == Piece::EE) {
-				moves.emplace_back(from, Pos{ newRow, newCol });
+		int32_t calcScore() const {
+			int32_t totalScore = 0;
 
-				newRow += rowVariation;
-				newCol += colVariation;
-				p = bd.get(newRow, newCol);
+			for (Side side : { Side::UP, Side::DOWN }) {
+				for (uint32_t i = 0; i < getPieceCount(side); ++i) {
+					Pos pos = toPos(getPieceSquare(side, i));
+					totalScore += scoreOf(get(pos), pos);
+				}
 			}
 
-			if (p != Piece::EO) {
-				newRow += rowVariation;
-				newCol += colVariation;
-				p = bd.get(newRow, newCol);
-
-				while (p != Piece::EO) {
-					Side ps = p_util::getSide(p);
+			return totalScore;
+		}
 
-					if (ps == p_util::getReverseSide(side)) {
-						moves.emplace_back(from, Pos{ newRow, newCol });
-						return;
-					}
-					else if (ps == side) {
-						return;
-					}
+		void move(const Move& m) {
+			const uint32_t from = m.from();
+			const uint32_t to = m.to();
+			Piece fromP = get(from);
+			Piece toP = get(to);
+			history.emplace_back(from, to, fromP, toP, pieceSlot[to], reversiblePlies);
+			keys.push_back(key);
+			reversiblePlies = toP == Piece::EE ? reversiblePlies + 1 : 0;
+
+			key ^= zobrist::getPieceKey(fromP, from);
+			key ^= zobrist::getPieceKey(toP, to);
+			key ^= zobrist::getPieceKey(fromP, to);
+			key ^= zobrist::getSideKey();
+
+			if (prefetchTable != nullptr) {
+				prefetchTT(prefetchTable, key);
+			}
 
-					newRow += rowVariation;
-					newCol += colVariation;
-					p = bd.get(newRow, newCol);
+			if (network != nullptr) {
+				network->movePiece(accumulator, fromP, toSquare90(from), toSquare90(to));
+				if (toP != Piece::EE) {
+					network->removePiece(accumulator, toP, toSquare90(to));
 				}
 			}
-		}
-
-		template<>
-		void addMoveOf<Type::ROOK>(Side side, const Board& bd, Moves& moves, const Pos& from, int32_t rowVariation, int32_t colVariation) {
-			uint32_t newRow = from.row + rowVariation;
-			uint32_t newCol = from.col + colVariation;
-			Piece p = bd.get(newRow, newCol);
 
-			while (p == Piece::EE) {
-				moves.emplace_back(from, Pos{ newRow, newCol });
+			score += scoreOf(fromP, to) - scoreOf(fromP, from) - scoreOf(toP, to);
 
-				newRow += rowVariation;
-				newCol += colVariation;
-				p = bd.get(newRow, newCol);
+			if (toP != Piece::EE) {
+				removeFromPieceList(p_util::getSide(toP), to);
 			}
+			relocateInPieceList(p_util::getSide(fromP), from, to);
 
-			if (p_util::getSide(p) == p_util::getReverseSide(side)) {
-				moves.emplace_back(from, Pos{ newRow, newCol });
+			if (p_util::getType(fromP) == Type::GENERAL) {
+				generalSquares[static_cast<uint32_t>(p_util::getSide(fromP))] = to;
 			}
-		}
-
-		template<>
-		void addMoveOf<Type::KNIGHT>(Side side, const Board& bd, Moves& moves, const Pos& from, const Pos& to, const Pos& middle) {
-			Piece middleP = bd.get(middle);
-			Piece toP = bd.get(to);
-
-			if (middleP == Piece::EE && toP != Piece::EO && p_util::getSide(toP) != side) {
-				moves.emplace_back(from, to);
+			if (p_util::getType(toP) == Type::GENERAL) {
+				generalSquares[static_cast<uint32_t>(p_util::getSide(toP))] = NO_SQUARE;
 			}
-		}
 
-		template<>
-		void addMoveOf<Type::BISHOP>(Side side, const Board& bd, Moves& moves, const Pos& from, const Pos& to, const Pos& middle) {
-			addMoveOf<Type::KNIGHT>(side, bd, moves, from, to, middle);
+			set(to, fromP);
+			set(from, Piece::EE);
 		}
 
-		template<>
-		void addMoveOf<Type::ADVISOR>(Side side, const Board& bd, Moves& moves, const Pos& from, const Pos& to) {
-			addMoveOf<Type::PAWN>(side, bd, moves, from, to);
-		}
+		void undo() {
+			if (history.empty()) {
+				return;
+			}
 
-		template<>
-		void addMoveOf<Type::GENERAL>(Side side, const Board& bd, Moves& moves, const Pos& from, const Pos& to) {
-			addMoveOf<Type::PAWN>(side, bd, moves, from, to);
-		}
+			const auto& historyNode = history.back();
 
-		template<Piece P, typename ... Args>
-		inline void addMove(Args&& ... args) {
-			addMoveOf<p_util::getType(P)>(p_util::getSide(P), std::forward<Args>(args)...);
-		}
+			reversiblePlies = historyNode.reversiblePlies;
+			key ^= zobrist::getSideKey();
+			key ^= zobrist::getPieceKey(historyNode.fromP, historyNode.to);
+			key ^= zobrist::getPieceKey(historyNode.toP, historyNode.to);
+			key ^= zobrist::getPieceKey(historyNode.fromP, historyNode.from);
 
-		template<Piece P>
-		void genMovesOf(const Board& bd, const Pos& pos, Moves& moves) {}
+			score += scoreOf(historyNode.fromP, historyNode.from) + scoreOf(historyNode.toP, historyNode.to) - scoreOf(historyNode.fromP, historyNode.to);
 
-		template<>
-		void genMovesOf<Piece::UP>(const Board& bd, const Pos& pos, Moves& moves) {
-			if (pos.row <= Board::LINE_UP_PAWN) {
-				addMove<Piece::UP>(bd, moves, pos, Pos{ pos.row + 1, pos.col });
+			if (network != nullptr) {
+				network->movePiece(accumulator, historyNode.fromP, toSquare90(historyNode.to), toSquare90(historyNode.from));
+				if (historyNode.toP != Piece::EE) {
+					network->addPiece(accumulator, historyNode.toP, toSquare90(historyNode.to));
+				}
 			}
-			else {
-				addMove<Piece::UP>(bd, moves, pos, Pos{ pos.row + 1, pos.col });
-				addMove<Piece::UP>(bd, moves, pos, Pos{ pos.row, pos.col - 1 });
-				addMove<Piece::UP>(bd, moves, pos, Pos{ pos.row, pos.col + 1 });
+
+			relocateInPieceList(p_util::getSide(historyNode.fromP), historyNode.to, historyNode.from);
+			if (historyNode.toP != Piece::EE) {
+				restoreToPieceList(p_util::getSide(historyNode.toP), historyNode.to, historyNode.toSlot);
 			}
-		}
 
-		template<>
-		void genMovesOf<Piece::DP>(const Board& bd, const Pos& pos, Moves& moves) {
-			if (pos.row >= Board::LINE_DOWN_PAWN) {
-				addMove<Piece::DP>(bd, moves, pos, Pos{ pos.row - 1, pos.col });
+			if (p_util::getType(historyNode.fromP) == Type::GENERAL) {
+				generalSquares[static_cast<uint32_t>(p_util::getSide(historyNode.fromP))] = historyNode.from;
 			}
-			else {
-				addMove<Piece::DP>(bd, moves, pos, Pos{ pos.row - 1, pos.col });
-				addMove<Piece::DP>(bd, moves, pos, Pos{ pos.row, pos.col - 1 });
-				addMove<Piece::DP>(bd, moves, pos, Pos{ pos.row, pos.col + 1 });
+			if (p_util::getType(historyNode.toP) == Type::GENERAL) {
+				generalSquares[static_cast<uint32_t>(p_util::getSide(historyNode.toP))] = historyNode.to;
 			}
-		}
 
-		template<>
-		void genMovesOf<Piece::UC>(const Board& bd, const Pos& pos, Moves& moves) {
-			addMove<Piece::UC>(bd, moves, pos, +1, 0);
-			addMove<Piece::UC>(bd, moves, pos, -1, 0);
-			addMove<Piece::UC>(bd, moves, pos, 0, +1);
-			addMove<Piece::UC>(bd, moves, pos, 0, -1);
+			set(historyNode.from, historyNode.fromP);
+			set(historyNode.to, historyNode.toP);
+			history.pop_back();
+			keys.pop_back();
 		}
 
-		template<>
-		void genMovesOf<Piece::DC>(const Board& bd, const Pos& pos, Moves& moves) {
-			addMove<Piece::DC>(bd, moves, pos, +1, 0);
-			addMove<Piece::DC>(bd, moves, pos, -1, 0);
-			addMove<Piece::DC>(bd, moves, pos, 0, +1);
-			addMove<Piece::DC>(bd, moves, pos, 0, -1);
+		// Passes the turn for null-move pruning, only the side to move changes. Repetitions don't reach back across it.
+		void moveNull() {
+			history.emplace_back(NO_SQUARE, NO_SQUARE, Piece::EE, Piece::EE, 0, reversiblePlies);
+			keys.push_back(key);
+			reversiblePlies = 0;
+			key ^= zobrist::getSideKey();
 		}
 
-		template<>
-		void genMovesOf<Piece::UR>(const Board& bd, const Pos& pos, Moves& moves) {
-			addMove<Piece::UR>(bd, moves, pos, +1, 0);
-			addMove<Piece::UR>(bd, moves, pos, -1, 0);
-			addMove<Piece::UR>(bd, moves, pos, 0, +1);
-			addMove<Piece::UR>(bd, moves, pos, 0, -1);
+		void undoNull() noexcept {
+			reversiblePlies = history.back().reversiblePlies;
+			history.pop_back();
+			keys.pop_back();
+			key ^= zobrist::getSideKey();
 		}
 
-		template<>
-		void genMovesOf<Piece::DR>(const Board& bd, const Pos& pos, Moves& moves) {
-			addMove<Piece::DR>(bd, moves, pos, +1, 0);
-			addMove<Piece::DR>(bd, moves, pos, -1, 0);
-			addMove<Piece::DR>(bd, moves, pos, 0, +1);
-			addMove<Piece::DR>(bd, moves, pos, 0, -1);
+		uint32_t getHistorySize() const noexcept {
+			return static_cast<uint32_t>(history.size());
 		}
 
-		template<>
-		void genMovesOf<Piece::UN>(const Board& bd, const Pos& pos, Moves& moves) {
-			addMove<Piece::UN>(bd, moves, pos, Pos{ pos.row + 2, pos.col + 1 }, Pos{ pos.row + 1, pos.col });
-			addMove<Piece::UN>(bd, moves, pos, Pos{ pos.row + 2, pos.col - 1 }, Pos{ pos.row + 1, pos.col });
-			addMove<Piece::UN>(bd, moves, pos, Pos{ pos.row - 2, pos.col + 1 }, Pos{ pos.row - 1, pos.col });
-			addMove<Piece::UN>(bd, moves, pos, Pos{ pos.row - 2, pos.col - 1 }, Pos{ pos.row - 1, pos.col });
-			addMove<Piece::UN>(bd, moves, pos, Pos{ pos.row + 1, pos.col + 2 }, Pos{ pos.row, pos.col + 1 });
-			addMove<Piece::UN>(bd, moves, pos, Pos{ pos.row + 1, pos.col - 2 }, Pos{ pos.row, pos.col - 1 });
-			addMove<Piece::UN>(bd, moves, pos, Pos{ pos.row - 1, pos.col + 2 }, Pos{ pos.row, pos.col + 1 });
-			addMove<Piece::UN>(bd, moves, pos, Pos{ pos.row - 1, pos.col - 2 }, Pos{ pos.row, pos.col - 1 });
+		// The move played back plies ago, 1 being the last one.
+		const HistoryNode& getHistory(uint32_t back) const noexcept {
+			return history[history.size() - back];
 		}
 
-		template<>
-		void genMovesOf<Piece::DN>(const Board& bd, const Pos& pos, Moves& moves) {
-			addMove<Piece::DN>(bd, moves, pos, Pos{ pos.row + 2, pos.col + 1 }, Pos{ pos.row + 1, pos.col });
-			addMove<Piece::DN>(bd, moves, pos, Pos{ pos.row + 2, pos.col - 1 }, Pos{ pos.row + 1, pos.col });
-			addMove<Piece::DN>(bd, moves, pos, Pos{ pos.row - 2, pos.col + 1 }, Pos{ pos.row - 1, pos.col });
-			addMove<Piece::DN>(bd, moves, pos, Pos{ pos.row - 2, pos.col - 1 }, Pos{ pos.row - 1, pos.col });
-			addMove<Piece::DN>(bd, moves, pos, Pos{ pos.row + 1, pos.col + 2 }, Pos{ pos.row, pos.col + 1 });
-			addMove<Piece::DN>(bd, moves, pos, Pos{ pos.row + 1, pos.col - 2 }, Pos{ pos.row, pos.col - 1 });
-			addMove<Piece::DN>(bd, moves, pos, Pos{ pos.row - 1, pos.col + 2 }, Pos{ pos.row, pos.col + 1 });
-			addMove<Piece::DN>(bd, moves, pos, Pos{ pos.row - 1, pos.col - 2 }, Pos{ pos.row, pos.col - 1 });
+		uint32_t getReversiblePlies() const noexcept {
+			return reversiblePlies;
 		}
 
-		template<>
-		void genMovesOf<Piece::UB>(const Board& bd, const Pos& pos, Moves& moves) {
-			if (pos.row + 2 <= Board::LINE_UP_PAWN) {
-				addMove<Piece::UB>(bd, moves, pos, Pos{ pos.row + 2, pos.col + 2 }, Pos{ pos.row + 1, pos.col + 1 });
-				addMove<Piece::UB>(bd, moves, pos, Pos{ pos.row + 2, pos.col - 2 }, Pos{ pos.row + 1, pos.col - 1 });
+		/*
+			How many plies ago the current position was last on the board, 0 when it wasn't since the last capture or
+			null move. Only positions with the same side to move are compared, and one move each way can't repeat.
+		*/
+		uint32_t findRepetition() const noexcept {
+			const size_t n = keys.size();
+			for (uint32_t back = 4; back <= reversiblePlies; back += 2) {
+				if (keys[n - back] == key) {
+					return back;
+				}
 			}
 
-			addMove<Piece::UB>(bd, moves, pos, Pos{ pos.row - 2, pos.col + 2 }, Pos{ pos.row - 1, pos.col + 1 });
-			addMove<Piece::UB>(bd, moves, pos, Pos{ pos.row - 2, pos.col - 2 }, Pos{ pos.row - 1, pos.col - 1 });
+			return 0;
 		}
 
-		template<>
-		void genMovesOf<Piece::DB>(const Board& bd, const Pos& pos, Moves& moves) {
-			addMove<Piece::DB>(bd, moves, pos, Pos{ pos.row + 2, pos.col + 2 }, Pos{ pos.row + 1, pos.col + 1 });
-			addMove<Piece::DB>(bd, moves, pos, Pos{ pos.row + 2, pos.col - 2 }, Pos{ pos.row + 1, pos.col - 1 });
-
-			if (pos.row - 2 >= Board::LINE_DOWN_PAWN) {
-				addMove<Piece::DB>(bd, moves, pos, Pos{ pos.row - 2, pos.col + 2 }, Pos{ pos.row - 1, pos.col + 1 });
-				addMove<Piece::DB>(bd, moves, pos, Pos{ pos.row - 2, pos.col - 2 }, Pos{ pos.row - 1, pos.col - 1 });
+		/*
+			Replaces the position, squares are rank * 9 + file from the top left like toSquare90. The history is
+			dropped, and the key has the side key toggled when UP is to move, as if the position was reached by moves.
+			The piece lists only hold legal material, see fen::hasLegalMaterial.
+		*/
+		void setPieces(const std::array<Piece, ROW_NUM * COL_NUM>& squares, Side sideToMove) {
+			for (uint32_t r = 0; r < ROW_NUM; ++r) {
+				for (uint32_t c = 0; c < COL_NUM; ++c) {
+					set(toSquare(r + ROW_BEGIN, c + COL_BEGIN), squares[r * COL_NUM + c]);
+				}
 			}
+
+			history.clear();
+			keys.clear();
+			reversiblePlies = 0;
+			initPieceLists();
+			key = calcKey() ^ (sideToMove == Side::UP ? zobrist::getSideKey() : 0);
+			score = calcScore();
+			refreshAccumulator();
 		}
+	};
 
-		template<>
-		void genMovesOf<Piece::UA>(const Board& bd, const Pos& pos, Moves& moves) {
-			if (pos.row + 1 <= Board::LINE_UP_9_BOTTOM && pos.col + 1 <= Board::LINE_UP_9_RIGHT) {
-				addMove<Piece::UA>(bd, moves, pos, Pos{ pos.row + 1, pos.col + 1 });
+	// C++11 needs a definition of a static constexpr member that is bound to a reference, as fill() and emplace_back() do.
+	constexpr uint32_t Board::NO_SQUARE;
+
+	inline Move::Move(const Pos& _from, const Pos& _to) : Move(Board::toSquare(_from), Board::toSquare(_to)) {}
+	inline Pos Move::fromPos() const noexcept { return Board::toPos(from()); }
+	inline Pos Move::toPos() const noexcept { return Board::toPos(to()); }
+
+	/*
+		FEN in the usual xiangqi form, "rnbakabnr/9/1c5c1/p1p1p1p1p/9/9/P1P1P1P1P/1C5C1/9/RNBAKABNR w - - 0 1". Ranks go
+		from the top, uppercase is red which is DOWN here, and 'w' or 'r' is DOWN to move. E and H are accepted for the
+		bishop and the knight. The fields after the side are ignored.
+	*/
+	namespace fen {
+		inline Piece pieceOf(char c) noexcept {
+			uint32_t base = std::isupper(static_cast<unsigned char>(c)) ? p_util::pieceToInt32(Piece::DP) : p_util::pieceToInt32(Piece::UP);
+			Type type{};
+
+			switch (std::toupper(static_cast<unsigned char>(c))) {
+			case 'P': type = Type::PAWN; break;
+			case 'C': type = Type::CANNON; break;
+			case 'R': type = Type::ROOK; break;
+			case 'N': case 'H': type = Type::KNIGHT; break;
+			case 'B': case 'E': type = Type::BISHOP; break;
+			case 'A': type = Type::ADVISOR; break;
+			case 'K': type = Type::GENERAL; break;
+			default: return Piece::EO;
 			}
 
-			if (pos.row + 1 <= Board::LINE_UP_9_BOTTOM && pos.col - 1 >= Board::LINE_UP_9_LEFT) {
-				addMove<Piece::UA>(bd, moves, pos, Pos{ pos.row + 1, pos.col - 1 });
+			return static_cast<Piece>(base + static_cast<uint32_t>(type));
+		}
+
+		// Pieces of each type a side starts with, by Type, no position can have more.
+		constexpr uint32_t MAX_PIECE_COUNT[] = { 5, 2, 2, 2, 2, 2, 1 };
+
+		/*
+			At most the starting pieces of every type and exactly one general a side, inside its palace. Board's piece
+			lists and the move list bound rely on it, so a FEN that breaks it is rejected instead of loaded.
+		*/
+		bool hasLegalMaterial(const std::array<Piece, Board::ROW_NUM * Board::COL_NUM>& squares) {
+			uint32_t counts[2][7] = {};
+
+			for (uint32_t i = 0; i < squares.size(); ++i) {
+				Piece p = squares[i];
+				if (p == Piece::EE) {
+					continue;
+				}
+
+				const Side side = p_util::getSide(p);
+				const uint32_t type = static_cast<uint32_t>(p_util::getType(p));
+				if (++counts[static_cast<uint32_t>(side)][type] > MAX_PIECE_COUNT[type]) {
+					return false;
+				}
+
+				if (p_util::getType(p) == Type::GENERAL) {
+					const uint32_t r = i / Board::COL_NUM + Board::ROW_BEGIN, c = i % Board::COL_NUM + Board::COL_BEGIN;
+					const bool inPalace = side == Side::UP
+						? r >= Board::LINE_UP_9_TOP && r <= Board::LINE_UP_9_BOTTOM && c >= Board::LINE_UP_9_LEFT && c <= Board::LINE_UP_9_RIGHT
+						: r >= Board::LINE_DOWN_9_TOP && r <= Board::LINE_DOWN_9_BOTTOM && c >= Board::LINE_DOWN_9_LEFT && c <= Board::LINE_DOWN_9_RIGHT;
+					if (!inPalace) {
+						return false;
+					}
+				}
 			}
 
-			if (pos.row - 1 >= Board::LINE_UP_9_TOP && pos.col + 1 <= Board::LINE_UP_9_RIGHT) {
-				addMove<Piece::UA>(bd, moves, pos, Pos{ pos.row - 1, pos.col + 1 });
+			const uint32_t general = static_cast<uint32_t>(Type::GENERAL);
+			return counts[0][general] == 1 && counts[1][general] == 1;
+		}
+
+		inline char charOf(Piece p) noexcept {
+			char c = "PCRNBAK"[static_cast<uint32_t>(p_util::getType(p))];
+			return p_util::getSide(p) == Side::DOWN ? c : static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+		}
+
+		bool parse(const std::string& str, std::array<Piece, Board::ROW_NUM * Board::COL_NUM>& squares, Side& sideToMove) {
+			std::istringstream in{ str };
+			std::string placement, side;
+
+			if (!(in >> placement)) {
+				return false;
 			}
 
-			if (pos.row - 1 >= Board::LINE_UP_9_TOP && pos.col - 1 >= Board::LINE_UP_9_LEFT) {
-				addMove<Piece::UA>(bd, moves, pos, Pos{ pos.row - 1, pos.col - 1 });
+			squares.fill(Piece::EE);
+			uint32_t row = 0, col = 0;
+
+			for (char c : placement) {
+				if (c == '/') {
+					if (col != Board::COL_NUM || ++row == Board::ROW_NUM) {
+						return false;
+					}
+					col = 0;
+				}
+				else if (c >= '1' && c <= '9') {
+					col += static_cast<uint32_t>(c - '0');
+					if (col > Board::COL_NUM) {
+						return false;
+					}
+				}
+				else {
+					Piece p = pieceOf(c);
+					if (p == Piece::EO || col == Board::COL_NUM) {
+						return false;
+					}
+					squares[row * Board::COL_NUM + col++] = p;
+				}
 			}
-		}
 
-		template<>
-		void genMovesOf<Piece::DA>(const Board& bd, const Pos& pos, Moves& moves) {
-			if (pos.row + 1 <= Board::LINE_DOWN_9_BOTTOM && pos.col + 1 <= Board::LINE_DOWN_9_RIGHT) {
-				addMove<Piece::DA>(bd, moves, pos, Pos{ pos.row + 1, pos.col + 1 });
+			if (row != Board::ROW_NUM - 1 || col != Board::COL_NUM || !hasLegalMaterial(squares)) {
+				return false;
 			}
 
-			if (pos.row + 1 <= Board::LINE_DOWN_9_BOTTOM && pos.col - 1 >= Board::LINE_DOWN_9_LEFT) {
-				addMove<Piece::DA>(bd, moves, pos, Pos{ pos.row + 1, pos.col - 1 });
+			sideToMove = Side::DOWN;
+			if (in >> side) {
+				if (side == "b") {
+					sideToMove = Side::UP;
+				}
+				else if (side != "w" && side != "r") {
+					return false;
+				}
 			}
 
-			if (pos.row - 1 >= Board::LINE_DOWN_9_TOP && pos.col + 1 <= Board::LINE_DOWN_9_RIGHT) {
-				addMove<Piece::DA>(bd, moves, pos, Pos{ pos.row - 1, pos.col + 1 });
+			return true;
+		}
+	};
+
+	bool setFen(Board& bd, const std::string& str, Side& sideToMove) {
+		std::array<Piece, Board::ROW_NUM * Board::COL_NUM> squares;
+
+		if (!fen::parse(str, squares, sideToMove)) {
+			return false;
+		}
+
+		bd.setPieces(squares, sideToMove);
+		return true;
+	}
+
+	// The counters aren't tracked, they are always written as "- - 0 1".
+	std::string toFen(const Board& bd, Side sideToMove) {
+		std::string str;
+
+		for (uint32_t r = Board::ROW_BEGIN; r < Board::ROW_END; ++r) {
+			uint32_t empty = 0;
+
+			for (uint32_t c = Board::COL_BEGIN; c < Board::COL_END; ++c) {
+				Piece p = bd.get(r, c);
+				if (p == Piece::EE) {
+					++empty;
+					continue;
+				}
+
+				if (empty != 0) {
+					str += static_cast<char>('0' + empty);
+					empty = 0;
+				}
+				str += fen::charOf(p);
 			}
 
-			if (pos.row - 1 >= Board::LINE_DOWN_9_TOP && pos.col - 1 >= Board::LINE_DOWN_9_LEFT) {
-				addMove<Piece::DA>(bd, moves, pos, Pos{ pos.row - 1, pos.col - 1 });
+			if (empty != 0) {
+				str += static_cast<char>('0' + empty);
+			}
+			if (r + 1 < Board::ROW_END) {
+				str += '/';
 			}
 		}
 
-		template<>
-		void genMovesOf<Piece::UG>(const Board& bd, const Pos& pos, Moves& moves) {
-			if (pos.row + 1 <= Board::LINE_UP_9_BOTTOM) {
-				addMove<Piece::UG>(bd, moves, pos, Pos{ pos.row + 1, pos.col });
+		return str + (sideToMove == Side::DOWN ? " w - - 0 1" : " b - - 0 1");
+	}
+
+	namespace zobrist {
+		/*
+			Keys come from a fixed-seed splitmix64, so a position always hashes to the same key from run to run.
+			EE and EO keep zero keys, that way empty squares need no special case in Board::move/undo.
+		*/
+		struct Keys {
+			uint64_t pieceKeys[16][Board::SQUARE_NUM];
+			uint64_t sideKey;
+
+			Keys() : pieceKeys{}, sideKey{} {
+				uint64_t seed = 0x9E3779B97F4A7C15ULL;
+
+				for (uint32_t p = p_util::pieceToInt32(Piece::UP); p <= p_util::pieceToInt32(Piece::DG); ++p) {
+					for (uint32_t r = Board::ROW_BEGIN; r < Board::ROW_END; ++r) {
+						for (uint32_t c = Board::COL_BEGIN; c < Board::COL_END; ++c) {
+							pieceKeys[p][Board::toSquare(r, c)] = next(seed);
+						}
+					}
+				}
+
+				sideKey = next(seed);
 			}
 
-			if (pos.row - 1 >= Board::LINE_UP_9_TOP) {
-				addMove<Piece::UG>(bd, moves, pos, Pos{ pos.row - 1, pos.col });
+			static uint64_t next(uint64_t& seed) noexcept {
+				uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+				z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+				z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+				return z ^ (z >> 31);
 			}
+		};
+
+		const Keys keys{};
+
+		inline uint64_t getPieceKey(Piece p, uint32_t sq) noexcept {
+			return keys.pieceKeys[p_util::pieceToInt32(p)][sq];
+		}
 
-			if (pos.col + 1 <= Board::LINE_UP_9_RIGHT) {
-				addMove<Piece::UG>(bd, moves, pos, Pos{ pos.row, pos.col + 1 });
+		inline uint64_t getSideKey() noexcept {
+			return keys.sideKey;
+		}
+	};
+
+	void printBoard(const Board& bd) {
+		Piece p;
+		uint32_t n = Board::ROW_NUM - 1;
+
+		std::cout << "\n";
+		for (uint32_t r = Board::ROW_BEGIN; r < Board::ROW_END; ++r) {
+			if (r == (Board::ROW_BEGIN + Board::ROW_END) / 2) {
+				std::cout << "  | =================\n";
+				std::cout << "  | =================\n";
 			}
 
-			if (pos.col - 1 >= Board::LINE_UP_9_LEFT) {
-				addMove<Piece::UG>(bd, moves, pos, Pos{ pos.row, pos.col - 1 });
+			std::cout << n-- << " | ";
+			for (uint32_t c = Board::COL_BEGIN; c < Board::COL_END; ++c) {
+				p = bd.get(r, c);
+				std::cout << p_util::getChar(p) << " ";
 			}
 
-			auto currentPos = Pos{ pos.row + 1, pos.col };
-			auto p = bd.get(currentPos);
-			
-			while (p == Piece::EE) {
-				++currentPos.row;
-				p = bd.get(currentPos);
+			std::cout << "\n";
+		}
+
+		std::cout << "  +------------------\n";
+		std::cout << "\n    a b c d e f g h i\n\n";
+	}
+
+	/*
+		Which moves a generator emits, CAPTURES is used by the quiescence search, CAPTURES and QUIETS by the stages of
+		the move picker.
+	*/
+	enum class GenType {
+		ALL, CAPTURES, QUIETS
+	};
+
+	inline constexpr bool wantsQuiets(GenType g) noexcept { return g != GenType::CAPTURES; }
+	inline constexpr bool wantsCaptures(GenType g) noexcept { return g != GenType::QUIETS; }
+
+	/*
+		Destination tables of the pieces that step instead of slide: pawns, knights, bishops, advisors and generals.
+		For every square of the padded board and every piece, the squares it can step to within its zone, in the
+		order the generators always emitted them, each with the leg (knight) or eye (bishop) square that has to be
+		empty. Built at compile time by expanding index packs over the squares and the steps, so a generator only
+		walks a short list.
+	*/
+	namespace step_table {
+		struct Step {
+			int32_t row, col, legRow, legCol;
+		};
+
+		struct Target {
+			uint8_t to, leg;
+		};
+
+		constexpr uint32_t MAX_STEPS = 8;
+
+		struct Targets {
+			uint8_t count;
+			Target targets[MAX_STEPS];
+		};
+
+		using Table = std::array<Targets, Board::SQUARE_NUM>;
+
+		constexpr Step knightSteps[] = {
+			{ +2, +1, +1, 0 }, { +2, -1, +1, 0 }, { -2, +1, -1, 0 }, { -2, -1, -1, 0 },
+			{ +1, +2, 0, +1 }, { +1, -2, 0, -1 }, { -1, +2, 0, +1 }, { -1, -2, 0, -1 },
+		};
+		constexpr Step bishopSteps[] = { { +2, +2, +1, +1 }, { +2, -2, +1, -1 }, { -2, +2, -1, +1 }, { -2, -2, -1, -1 } };
+		constexpr Step advisorSteps[] = { { +1, +1, 0, 0 }, { +1, -1, 0, 0 }, { -1, +1, 0, 0 }, { -1, -1, 0, 0 } };
+		constexpr Step generalSteps[] = { { +1, 0, 0, 0 }, { -1, 0, 0, 0 }, { 0, +1, 0, 0 }, { 0, -1, 0, 0 } };
+		constexpr Step upPawnSteps[] = { { +1, 0, 0, 0 }, { 0, -1, 0, 0 }, { 0, +1, 0, 0 } };
+		constexpr Step downPawnSteps[] = { { -1, 0, 0, 0 }, { 0, -1, 0, 0 }, { 0, +1, 0, 0 } };
+
+		constexpr uint32_t stepNumOf(Type t) noexcept {
+			return t == Type::KNIGHT ? 8 : t == Type::PAWN ? 3 : t == Type::BISHOP || t == Type::ADVISOR || t == Type::GENERAL ? 4 : 0;
+		}
+
+		constexpr Step stepOf(Piece p, uint32_t i) noexcept {
+			return p_util::getType(p) == Type::KNIGHT ? knightSteps[i]
+				: p_util::getType(p) == Type::BISHOP ? bishopSteps[i]
+				: p_util::getType(p) == Type::ADVISOR ? advisorSteps[i]
+				: p_util::getType(p) == Type::GENERAL ? generalSteps[i]
+				: p == Piece::UP ? upPawnSteps[i] : downPawnSteps[i];
+		}
+
+		constexpr bool inBoard(int32_t row, int32_t col) noexcept {
+			return row >= static_cast<int32_t>(Board::ROW_BEGIN) && row < static_cast<int32_t>(Board::ROW_END)
+				&& col >= static_cast<int32_t>(Board::COL_BEGIN) && col < static_cast<int32_t>(Board::COL_END);
+		}
+
+		constexpr int32_t palaceTop(Side side) noexcept {
+			return static_cast<int32_t>(side == Side::UP ? Board::LINE_UP_9_TOP : Board::LINE_DOWN_9_TOP);
+		}
+
+		constexpr int32_t palaceBottom(Side side) noexcept {
+			return static_cast<int32_t>(side == Side::UP ? Board::LINE_UP_9_BOTTOM : Board::LINE_DOWN_9_BOTTOM);
+		}
+
+		// Only the palace edge the step moves towards is checked, which only matters after a general flew out to capture.
+		constexpr bool inPalaceTowards(Side side, const Step& s, int32_t toRow, int32_t toCol) noexcept {
+			return (s.row > 0 ? toRow <= palaceBottom(side) : s.row < 0 ? toRow >= palaceTop(side) : true)
+				&& (s.col > 0 ? toCol <= static_cast<int32_t>(Board::LINE_UP_9_RIGHT) : s.col < 0 ? toCol >= static_cast<int32_t>(Board::LINE_UP_9_LEFT) : true);
+		}
+
+		constexpr bool inOwnHalf(Side side, int32_t row) noexcept {
+			return side == Side::UP ? row <= static_cast<int32_t>(Board::LINE_UP_PAWN) : row >= static_cast<int32_t>(Board::LINE_DOWN_PAWN);
+		}
+
+		// Whether p standing on row may take step s to (toRow, toCol), pawns go sideways only past the river.
+		constexpr bool canStep(Piece p, int32_t row, const Step& s, int32_t toRow, int32_t toCol) noexcept {
+			return inBoard(toRow, toCol) && (
+				p_util::getType(p) == Type::BISHOP ? inOwnHalf(p_util::getSide(p), toRow)
+				: p_util::getType(p) == Type::ADVISOR || p_util::getType(p) == Type::GENERAL ? inPalaceTowards(p_util::getSide(p), s, toRow, toCol)
+				: p_util::getType(p) == Type::PAWN ? s.row != 0 || !inOwnHalf(p_util::getSide(p), row)
+				: true);
+		}
+
+		constexpr bool isValid(Piece p, uint32_t sq, uint32_t i) noexcept {
+			return canStep(p, static_cast<int32_t>(sq / Board::ACTUAL_COL_NUM), stepOf(p, i),
+				static_cast<int32_t>(sq / Board::ACTUAL_COL_NUM) + stepOf(p, i).row, static_cast<int32_t>(sq % Board::ACTUAL_COL_NUM) + stepOf(p, i).col);
+		}
+
+		constexpr uint32_t countOf(Piece p, uint32_t sq, uint32_t i = 0) noexcept {
+			return i >= stepNumOf(p_util::getType(p)) ? 0 : (isValid(p, sq, i) ? 1 : 0) + countOf(p, sq, i + 1);
+		}
+
+		// Index of the n-th valid step from i on.
+		constexpr uint32_t nthValid(Piece p, uint32_t sq, uint32_t n, uint32_t i = 0) noexcept {
+			return !isValid(p, sq, i) ? nthValid(p, sq, n, i + 1) : n == 0 ? i : nthValid(p, sq, n - 1, i + 1);
+		}
+
+		constexpr Target targetOf(const Step& s, uint32_t sq) noexcept {
+			return Target{ static_cast<uint8_t>(static_cast<int32_t>(sq) + s.row * static_cast<int32_t>(Board::ACTUAL_COL_NUM) + s.col),
+				static_cast<uint8_t>(static_cast<int32_t>(sq) + s.legRow * static_cast<int32_t>(Board::ACTUAL_COL_NUM) + s.legCol) };
+		}
+
+		constexpr Target nthTarget(Piece p, uint32_t sq, uint32_t n) noexcept {
+			return n < countOf(p, sq) ? targetOf(stepOf(p, nthValid(p, sq, n)), sq) : Target{ 0, 0 };
+		}
+
+		template<uint32_t ... I>
+		struct Indexes {};
+
+		template<uint32_t N, uint32_t ... I>
+		struct MakeIndexes : MakeIndexes<N - 1, N - 1, I ...> {};
+
+		template<uint32_t ... I>
+		struct MakeIndexes<0, I ...> {
+			using type = Indexes<I ...>;
+		};
+
+		template<uint32_t ... N>
+		constexpr Targets targetsOf(Piece p, uint32_t sq, Indexes<N ...>) noexcept {
+			return Targets{ static_cast<uint8_t>(countOf(p, sq)), { nthTarget(p, sq, N) ... } };
+		}
+
+		template<uint32_t ... S>
+		constexpr Table tableOf(Piece p, Indexes<S ...>) noexcept {
+			return Table{ { targetsOf(p, S, MakeIndexes<MAX_STEPS>::type{}) ... } };
+		}
+
+		constexpr Table makeTable(Piece p) noexcept {
+			return tableOf(p, MakeIndexes<Board::SQUARE_NUM>::type{});
+		}
+
+		// Indexed by Piece, the rook and cannon tables are empty.
+		constexpr std::array<Table, 14> tables = { {
+			makeTable(Piece::UP), makeTable(Piece::UC), makeTable(Piece::UR), makeTable(Piece::UN),
+			makeTable(Piece::UB), makeTable(Piece::UA), makeTable(Piece::UG),
+			makeTable(Piece::DP), makeTable(Piece::DC), makeTable(Piece::DR), makeTable(Piece::DN),
+			makeTable(Piece::DB), makeTable(Piece::DA), makeTable(Piece::DG),
+		} };
+	};
+
+	namespace gen_moves {
+		/*
+			Function templates can't be partially specialized, so the per-type and per-piece generators are class
+			specializations holding a member template on GenType.
+		*/
+		template<Type T>
+		struct AddMoveOf {};
+
+		template<>
+		struct AddMoveOf<Type::CANNON> {
+			template<GenType G>
+			static void add(Side side, const Board& bd, Moves& moves, const Pos& from, int32_t rowVariation, int32_t colVariation) {
+				uint32_t newRow = from.row + rowVariation;
+				uint32_t newCol = from.col + colVariation;
+				Piece p = bd.get(newRow, newCol);
+
+				while (p == Piece::EE) {
+					if (wantsQuiets(G)) {
+						moves.emplace_back(from, Pos{ newRow, newCol });
+					}
+
+					newRow += rowVariation;
+					newCol += colVariation;
+					p = bd.get(newRow, newCol);
+				}
+
+				if (p != Piece::EO && wantsCaptures(G)) {
+					newRow += rowVariation;
+					newCol += colVariation;
+					p = bd.get(newRow, newCol);
+
+					while (p != Piece::EO) {
+						Side ps = p_util::getSide(p);
+
+						if (ps == p_util::getReverseSide(side)) {
+							moves.emplace_back(from, Pos{ newRow, newCol });
+							return;
+						}
+						else if (ps == side) {
+							return;
+						}
+
+						newRow += rowVariation;
+						newCol += colVariation;
+						p = bd.get(newRow, newCol);
+					}
+				}
 			}
+		};
 
-			if (p == Piece::DG) {
-				moves.emplace_back(pos, currentPos);
+		template<>
+		struct AddMoveOf<Type::ROOK> {
+			template<GenType G>
+			static void add(Side side, const Board& bd, Moves& moves, const Pos& from, int32_t rowVariation, int32_t colVariation) {
+				uint32_t newRow = from.row + rowVariation;
+				uint32_t newCol = from.col + colVariation;
+				Piece p = bd.get(newRow, newCol);
+
+				while (p == Piece::EE) {
+					if (wantsQuiets(G)) {
+						moves.emplace_back(from, Pos{ newRow, newCol });
+					}
+
+					newRow += rowVariation;
+					newCol += colVariation;
+					p = bd.get(newRow, newCol);
+				}
+
+				if (wantsCaptures(G) && p_util::getSide(p) == p_util::getReverseSide(side)) {
+					moves.emplace_back(from, Pos{ newRow, newCol });
+				}
+			}
+		};
+
+		template<Piece P, GenType G, typename ... Args>
+		inline void addMove(Args&& ... args) {
+			AddMoveOf<p_util::getType(P)>::template add<G>(p_util::getSide(P), std::forward<Args>(args)...);
+		}
+
+		// Pawns, knights, bishops, advisors and generals, from their step table.
+		template<Piece P, GenType G>
+		inline void genStepMoves(const Board& bd, const Pos& pos, Moves& moves) {
+			constexpr bool needsLeg = p_util::getType(P) == Type::KNIGHT || p_util::getType(P) == Type::BISHOP;
+			const uint32_t from = Board::toSquare(pos);
+			const step_table::Targets& targets = step_table::tables[p_util::pieceToInt32(P)][from];
+
+			for (uint32_t i = 0; i < targets.count; ++i) {
+				const step_table::Target& t = targets.targets[i];
+				Piece toP = bd.get(t.to);
+
+				if ((!needsLeg || bd.get(t.leg) == Piece::EE) && p_util::getSide(toP) != p_util::getSide(P)
+					&& (toP == Piece::EE ? wantsQuiets(G) : wantsCaptures(G))) {
+					moves.emplace_back(from, t.to);
+				}
 			}
 		}
 
+		template<Piece P>
+		struct GenMovesOf {
+			template<GenType G>
+			static void gen(const Board& bd, const Pos& pos, Moves& moves) {
+				genStepMoves<P, G>(bd, pos, moves);
+			}
+		};
+
 		template<>
-		void genMovesOf<Piece::DG>(const Board& bd, const Pos& pos, Moves& moves) {
-			if (pos.row + 1 <= Board::LINE_DOWN_9_BOTTOM) {
-				addMove<Piece::DG>(bd, moves, pos, Pos{ pos.row + 1, pos.col });
+		struct GenMovesOf<Piece::UC> {
+			template<GenType G>
+			static void gen(const Board& bd, const Pos& pos, Moves& moves) {
+				addMove<Piece::UC, G>(bd, moves, pos, +1, 0);
+				addMove<Piece::UC, G>(bd, moves, pos, -1, 0);
+				addMove<Piece::UC, G>(bd, moves, pos, 0, +1);
+				addMove<Piece::UC, G>(bd, moves, pos, 0, -1);
 			}
+		};
 
-			if (pos.row - 1 >= Board::LINE_DOWN_9_TOP) {
-				addMove<Piece::DG>(bd, moves, pos, Pos{ pos.row - 1, pos.col });
+		template<>
+		struct GenMovesOf<Piece::DC> {
+			template<GenType G>
+			static void gen(const Board& bd, const Pos& pos, Moves& moves) {
+				addMove<Piece::DC, G>(bd, moves, pos, +1, 0);
+				addMove<Piece::DC, G>(bd, moves, pos, -1, 0);
+				addMove<Piece::DC, G>(bd, moves, pos, 0, +1);
+				addMove<Piece::DC, G>(bd, moves, pos, 0, -1);
 			}
+		};
 
-			if (pos.col + 1 <= Board::LINE_DOWN_9_RIGHT) {
-				addMove<Piece::DG>(bd, moves, pos, Pos{ pos.row, pos.col + 1 });
+		template<>
+		struct GenMovesOf<Piece::UR> {
+			template<GenType G>
+			static void gen(const Board& bd, const Pos& pos, Moves& moves) {
+				addMove<Piece::UR, G>(bd, moves, pos, +1, 0);
+				addMove<Piece::UR, G>(bd, moves, pos, -1, 0);
+				addMove<Piece::UR, G>(bd, moves, pos, 0, +1);
+				addMove<Piece::UR, G>(bd, moves, pos, 0, -1);
 			}
+		};
 
-			if (pos.col - 1 >= Board::LINE_DOWN_9_LEFT) {
-				addMove<Piece::DG>(bd, moves, pos, Pos{ pos.row, pos.col - 1 });
+		template<>
+		struct GenMovesOf<Piece::DR> {
+			template<GenType G>
+			static void gen(const Board& bd, const Pos& pos, Moves& moves) {
+				addMove<Piece::DR, G>(bd, moves, pos, +1, 0);
+				addMove<Piece::DR, G>(bd, moves, pos, -1, 0);
+				addMove<Piece::DR, G>(bd, moves, pos, 0, +1);
+				addMove<Piece::DR, G>(bd, moves, pos, 0, -1);
 			}
+		};
+
+		template<>
+		struct GenMovesOf<Piece::UG> {
+			template<GenType G>
+			static void gen(const Board& bd, const Pos& pos, Moves& moves) {
+				genStepMoves<Piece::UG, G>(bd, pos, moves);
 
-			auto currentPos = Pos{ pos.row - 1, pos.col };
-			auto p = bd.get(currentPos);
+				auto currentPos = Pos{ pos.row + 1, pos.col };
+				auto p = bd.get(currentPos);
+			
+				while (p == Piece::EE) {
+					++currentPos.row;
+					p = bd.get(currentPos);
+				}
 
-			while (p == Piece::EE) {
-				--currentPos.row;
-				p = bd.get(currentPos);
+				if (p == Piece::DG && wantsCaptures(G)) {
+					moves.emplace_back(pos, currentPos);
+				}
 			}
+		};
 
-			if (p == Piece::UG) {
-				moves.emplace_back(pos, currentPos);
+		template<>
+		struct GenMovesOf<Piece::DG> {
+			template<GenType G>
+			static void gen(const Board& bd, const Pos& pos, Moves& moves) {
+				genStepMoves<Piece::DG, G>(bd, pos, moves);
+
+				auto currentPos = Pos{ pos.row - 1, pos.col };
+				auto p = bd.get(currentPos);
+
+				while (p == Piece::EE) {
+					--currentPos.row;
+					p = bd.get(currentPos);
+				}
+
+				if (p == Piece::UG && wantsCaptures(G)) {
+					moves.emplace_back(pos, currentPos);
+				}
 			}
+		};
+
+		template<Piece P, GenType G>
+		void genMovesOf(const Board& bd, const Pos& pos, Moves& moves) {
+			GenMovesOf<P>::template gen<G>(bd, pos, moves);
 		}
 
 		using GenMovesMethod = void(*)(const Board& bd, const Pos& pos, Moves& moves);
 
-		constexpr static GenMovesMethod methods[] = {
-			&genMovesOf<Piece::UP>,
-			&genMovesOf<Piece::UC>,
-			&genMovesOf<Piece::UR>,
-			&genMovesOf<Piece::UN>,
-			&genMovesOf<Piece::UB>,
-			&genMovesOf<Piece::UA>,
-			&genMovesOf<Piece::UG>,
-			&genMovesOf<Piece::DP>,
-			&genMovesOf<Piece::DC>,
-			&genMovesOf<Piece::DR>,
-			&genMovesOf<Piece::DN>,
-			&genMovesOf<Piece::DB>,
-			&genMovesOf<Piece::DA>,
-			&genMovesOf<Piece::DG>,
-		};
+		template<GenType G>
+		inline GenMovesMethod getMethod(Piece p) {
+			constexpr static GenMovesMethod methods[] = {
+				&genMovesOf<Piece::UP, G>,
+				&genMovesOf<Piece::UC, G>,
+				&genMovesOf<Piece::UR, G>,
+				&genMovesOf<Piece::UN, G>,
+				&genMovesOf<Piece::UB, G>,
+				&genMovesOf<Piece::UA, G>,
+				&genMovesOf<Piece::UG, G>,
+				&genMovesOf<Piece::DP, G>,
+				&genMovesOf<Piece::DC, G>,
+				&genMovesOf<Piece::DR, G>,
+				&genMovesOf<Piece::DN, G>,
+				&genMovesOf<Piece::DB, G>,
+				&genMovesOf<Piece::DA, G>,
+				&genMovesOf<Piece::DG, G>,
+			};
+
+			return methods[p_util::pieceToInt32(p)];
+		}
 	};
 
 	inline void genMoves(const Board& bd, const Pos& pos, Moves& moves) {
 		Piece p = bd.get(pos);
-		gen_moves::methods[p_util::pieceToInt32(p)](bd, pos, moves);
+		gen_moves::getMethod<GenType::ALL>(p)(bd, pos, moves);
 	}
 
-	template<Side side, typename = typename std::enable_if<side == Side::UP || side == Side::DOWN, bool>::type>
+	template<Side side, GenType G = GenType::ALL, typename = typename std::enable_if<side == Side::UP || side == Side::DOWN, bool>::type>
 	void genMoves(const Board& bd, Moves& moves) {
-		Piece p{};
+		for (uint32_t i = 0; i < bd.getPieceCount(side); ++i) {
+			Pos pos = Board::toPos(bd.getPieceSquare(side, i));
+			gen_moves::getMethod<G>(bd.get(pos))(bd, pos, moves);
+		}
+	}
 
-		for (uint32_t r = Board::ROW_BEGIN; r < Board::ROW_END; ++r) {
-			for (uint32_t c = Board::COL_BEGIN; c < Board::COL_END; ++c) {
-				p = bd.get(r, c);
-				if (p_util::getSide(p) == side) {
-					gen_moves::methods[p_util::pieceToInt32(p)](bd, Pos{ r, c }, moves);
-				}
+	/*
+		Attack detection by looking outwards from the attacked square: the pieces that could attack it sit at fixed
+		offsets (knights, pawns) or are the first/second piece along a line (rooks, the facing general, cannons).
+		Advisors and bishops never leave their own half, so they can't attack the other side's general and aren't checked.
+	*/
+	namespace attack {
+		constexpr int32_t ROW_STEP = static_cast<int32_t>(Board::ACTUAL_COL_NUM);
+
+		constexpr int32_t lineSteps[] = { -ROW_STEP, +ROW_STEP, -1, +1 };
+
+		// A knight attacking the square stands at source, the leg it needs free is the diagonal neighbour of the square.
+		struct KnightAttack {
+			int32_t leg, source;
+		};
+
+		constexpr KnightAttack knightAttacks[] = {
+			{ -ROW_STEP - 1, -2 * ROW_STEP - 1 }, { -ROW_STEP - 1, -ROW_STEP - 2 },
+			{ -ROW_STEP + 1, -2 * ROW_STEP + 1 }, { -ROW_STEP + 1, -ROW_STEP + 2 },
+			{ +ROW_STEP - 1, +2 * ROW_STEP - 1 }, { +ROW_STEP - 1, +ROW_STEP - 2 },
+			{ +ROW_STEP + 1, +2 * ROW_STEP + 1 }, { +ROW_STEP + 1, +ROW_STEP + 2 },
+		};
+	};
+
+	/*
+		Is sq attacked by a piece of side by. The generals facing each other on an open file counts as an attack,
+		so asking this for a general's square answers whether that side is in check.
+	*/
+	template<Side by>
+	bool isSquareAttacked(const Board& bd, uint32_t sq) {
+		constexpr bool byUp = by == Side::UP;
+		constexpr Piece rook = byUp ? Piece::UR : Piece::DR;
+		constexpr Piece cannon = byUp ? Piece::UC : Piece::DC;
+		constexpr Piece knight = byUp ? Piece::UN : Piece::DN;
+		constexpr Piece pawn = byUp ? Piece::UP : Piece::DP;
+		constexpr Piece general = byUp ? Piece::UG : Piece::DG;
+
+		for (const auto& knightAttack : attack::knightAttacks) {
+			if (bd.get(sq + knightAttack.source) == knight && bd.get(sq + knightAttack.leg) == Piece::EE) {
+				return true;
+			}
+		}
+
+		// UP pawns move towards higher rows and sideways once they are past the river, DOWN pawns mirror that.
+		const uint32_t row = Board::toPos(sq).row;
+		if (bd.get(byUp ? sq - attack::ROW_STEP : sq + attack::ROW_STEP) == pawn) {
+			return true;
+		}
+
+		if ((byUp ? row > Board::LINE_UP_PAWN : row < Board::LINE_DOWN_PAWN) && (bd.get(sq - 1) == pawn || bd.get(sq + 1) == pawn)) {
+			return true;
+		}
+
+		for (int32_t step : attack::lineSteps) {
+			uint32_t s = sq + step;
+			while (bd.get(s) == Piece::EE) {
+				s += step;
+			}
+
+			Piece first = bd.get(s);
+			if (first == rook || (first == general && (step == attack::ROW_STEP || step == -attack::ROW_STEP))) {
+				return true;
+			}
+
+			if (first == Piece::EO) {
+				continue;
+			}
+
+			s += step;
+			while (bd.get(s) == Piece::EE) {
+				s += step;
+			}
+
+			if (bd.get(s) == cannon) {
+				return true;
 			}
 		}
+
+		return false;
 	}
 
-	bool isValidMove(const Board& bd, const Move& m) {
-		Moves moves;
-		genMoves(bd, m.from, moves);
+	template<Side side>
+	bool inCheck(const Board& bd) {
+		uint32_t sq = bd.getGeneralSquare(side);
+		return sq != Board::NO_SQUARE && isSquareAttacked<p_util::getReverseSide(side)>(bd, sq);
+	}
+
+	inline bool inCheck(const Board& bd, Side side) {
+		return side == Side::UP ? inCheck<Side::UP>(bd) : inCheck<Side::DOWN>(bd);
+	}
+
+	/*
+		Legal moves: the pseudo-legal ones that don't leave the own general attacked, including by the facing general.
+	*/
+	template<Side side, GenType G = GenType::ALL>
+	void genLegalMoves(Board& bd, Moves& moves) {
+		Moves pseudoMoves;
+		genMoves<side, G>(bd, pseudoMoves);
+
+		for (const auto& m : pseudoMoves) {
+			bd.move(m);
+			if (!inCheck<side>(bd)) {
+				moves.push_back(m);
+			}
+			bd.undo();
+		}
+	}
+
+	// Whether a move from elsewhere, a hash move or a killer, can be played by side in this position.
+	template<Side side>
+	bool isPseudoLegal(const Board& bd, const Move& m) {
+		Piece p = bd.get(m.from());
+		if (p == Piece::EE || p == Piece::EO || p_util::getSide(p) != side) {
+			return false;
+		}
 
+		Moves moves;
+		gen_moves::getMethod<GenType::ALL>(p)(bd, m.fromPos(), moves);
 		return std::find(moves.cbegin(), moves.cend(), m) != moves.cend();
 	}
 
-	namespace value {
-		constexpr int32_t pieceValueMap[] = {
-			-20, -50, -100, -50, -10, -10, -10000,
-			+20, +50, +100, +50, +10, +10, +10000,
-			  0,   0
-		};
+	// perft over legal moves only, the counts can be compared with other engines.
+	template<Side side>
+	uint64_t perftLegal(Board& bd, uint32_t depth) {
+		Moves moves;
+		genLegalMoves<side>(bd, moves);
 
-		constexpr int32_t posValueMap[][Board::ROW_NUM][Board::COL_NUM] = {
-			// UP
-			{
+		if (depth <= 1) {
+			return depth == 1 ? moves.size() : 1;
+		}
+
+		uint64_t nodes = 0;
+		for (const auto& m : moves) {
+			bd.move(m);
+			nodes += perftLegal<p_util::getReverseSide(side)>(bd, depth - 1);
+			bd.undo();
+		}
+
+		return nodes;
+	}
+
+	template<Side side>
+	bool hasLegalMove(Board& bd) {
+		Moves moves;
+		genLegalMoves<side>(bd, moves);
+		return !moves.empty();
+	}
+
+	bool isValidMove(const Board& bd, const Move& m) {
+		Moves moves;
+		genMoves(bd, m.fromPos(), moves);
+
+		if (std::find(moves.cbegin(), moves.cend(), m) == moves.cend()) {
+			return false;
+		}
+
+		Board next = bd;
+		next.move(m);
+		return !inCheck(next, p_util::getSide(bd.get(m.from())));
+	}
+
+	// Without a rook, knight or cannon a side is likely in zugzwang-like positions where passing would be wrong.
+	template<Side side>
+	bool hasMajorPiece(const Board& bd) {
+		for (uint32_t i = 0; i < bd.getPieceCount(side); ++i) {
+			Type t = p_util::getType(bd.get(bd.getPieceSquare(side, i)));
+			if (t == Type::ROOK || t == Type::KNIGHT || t == Type::CANNON) {
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	/*
+		Repeated positions, judged by a simplified form of the Asian rules. Over the moves of the cycle each side
+		either checked with every move, chased with every move (check or chase), or did neither. The side doing the
+		more forcing thing loses, perpetual check being more forcing than perpetual chase, and equal sides draw.
+
+		A move chases when it leaves some enemy piece attacked that wasn't before: a legal capture of it that isn't
+		answered by a recapture, or that wins a piece worth more than the capturer. Generals and pawns may attack at
+		will, and the general and pawns that haven't crossed the river can't be chased.
+	*/
+	enum class Repetition {
+		NONE, DRAW, WIN, LOSS
+	};
+
+	namespace repetition {
+		enum Severity : uint32_t {
+			IDLE, CHASE, CHECK
+		};
+
+		template<Side side>
+		bool canCaptureOn(Board& bd, uint32_t sq) {
+			Moves captures;
+			genLegalMoves<side, GenType::CAPTURES>(bd, captures);
+			return std::any_of(captures.cbegin(), captures.cend(), [sq](const Move& m) { return m.to() == sq; });
+		}
+
+		inline bool canBeChased(Piece p, uint32_t sq) noexcept {
+			const uint32_t row = Board::toPos(sq).row;
+
+			switch (p_util::getType(p)) {
+			case Type::GENERAL: return false;
+			case Type::PAWN: return p_util::getSide(p) == Side::UP ? row > Board::LINE_UP_PAWN : row < Board::LINE_DOWN_PAWN;
+			default: return true;
+			}
+		}
+
+		// Marks the squares of the enemy pieces side chases in this position.
+		template<Side side>
+		void markChased(Board& bd, std::array<bool, Board::SQUARE_NUM>& chased) {
+			constexpr Side enemy = p_util::getReverseSide(side);
+			Moves captures;
+			genLegalMoves<side, GenType::CAPTURES>(bd, captures);
+			chased.fill(false);
+
+			for (const auto& m : captures) {
+				const Piece attacker = bd.get(m.from()), victim = bd.get(m.to());
+				const Type attackerType = p_util::getType(attacker);
+				if (chased[m.to()] || attackerType == Type::GENERAL || attackerType == Type::PAWN || !canBeChased(victim, m.to())) {
+					continue;
+				}
+
+				if (std::abs(getPieceValue(victim)) > std::abs(getPieceValue(attacker))) {
+					chased[m.to()] = true;
+					continue;
+				}
+
+				bd.move(m);
+				chased[m.to()] = !canCaptureOn<enemy>(bd, m.to());
+				bd.undo();
+			}
+		}
+
+		// How forcing m is, played by side.
+		template<Side side>
+		Severity severityOf(Board& bd, const Move& m) {
+			std::array<bool, Board::SQUARE_NUM> before, after;
+			markChased<side>(bd, before);
+
+			bd.move(m);
+			Severity severity = IDLE;
+			if (inCheck<p_util::getReverseSide(side)>(bd)) {
+				severity = CHECK;
+			}
+			else {
+				markChased<side>(bd, after);
+				for (uint32_t sq = 0; sq < Board::SQUARE_NUM; ++sq) {
+					if (after[sq] && !before[sq]) {
+						severity = CHASE;
+						break;
+					}
+				}
+			}
+			bd.undo();
+
+			return severity;
+		}
+	};
+
+	/*
+		Whether the position is a repetition and how it ends for side, the side to move. The cycle is replayed from
+		the previous occurrence to classify the moves, so this is only cheap when there is no repetition.
+	*/
+	template<Side side>
+	Repetition checkRepetition(Board& bd) {
+		constexpr Side enemy = p_util::getReverseSide(side);
+		const uint32_t back = bd.findRepetition();
+		if (back == 0) {
+			return Repetition::NONE;
+		}
+
+		std::vector<Move> cycle(back);
+		for (uint32_t i = back; i-- > 0;) {
+			cycle[i] = Move{ bd.getHistory(1).from, bd.getHistory(1).to };
+			bd.undo();
+		}
+
+		// The cycle starts and ends with side to move, so its moves alternate from side.
+		std::array<uint32_t, 2> severity{ { repetition::CHECK, repetition::CHECK } };
+		for (uint32_t i = 0; i < back; ++i) {
+			const bool bySide = i % 2 == 0;
+			uint32_t s = bySide ? repetition::severityOf<side>(bd, cycle[i]) : repetition::severityOf<enemy>(bd, cycle[i]);
+			uint32_t& worst = severity[static_cast<uint32_t>(bySide ? side : enemy)];
+			worst = std::min(worst, s);
+			bd.move(cycle[i]);
+		}
+
+		const uint32_t own = severity[static_cast<uint32_t>(side)], other = severity[static_cast<uint32_t>(enemy)];
+		return own == other ? Repetition::DRAW : own > other ? Repetition::LOSS : Repetition::WIN;
+	}
+
+	inline Repetition checkRepetition(Board& bd, Side side) {
+		return side == Side::UP ? checkRepetition<Side::UP>(bd) : checkRepetition<Side::DOWN>(bd);
+	}
+
+	/*
+		Alternative board backend on bitboards, it has the same move()/undo() and genMoves interface as Board so the
+		two can be benchmarked against each other. Squares are numbered rank * 9 + file over the 90 real squares,
+		rank 0 being the UP side.
+
+		Rook and cannon moves come from rank/file occupancy lookup tables: each rank and file keeps its occupancy as
+		a small bit mask, which indexes a table of the reachable squares. Knight, bishop, advisor, general and pawn
+		moves come from per-square tables, knight and bishop tables are also indexed by which of the four leg/eye
+		squares are blocked.
+	*/
+	namespace bitboard {
+		constexpr uint32_t SQUARE_NUM = Board::ROW_NUM * Board::COL_NUM;
+		constexpr uint32_t NO_SQUARE = SQUARE_NUM;
+
+		inline uint32_t lsb(uint64_t x) noexcept {
+#if defined(_MSC_VER)
+			unsigned long index;
+			_BitScanForward64(&index, x);
+			return static_cast<uint32_t>(index);
+#else
+			return static_cast<uint32_t>(__builtin_ctzll(x));
+#endif
+		}
+
+		/*
+			90 squares in two words, bits 0-63 in lo and 64-89 in hi.
+		*/
+		struct Bitboard {
+			uint64_t lo, hi;
+
+			Bitboard() : lo(0), hi(0) {}
+			Bitboard(uint64_t _lo, uint64_t _hi) : lo(_lo), hi(_hi) {}
+
+			static Bitboard of(uint32_t sq) noexcept {
+				return sq < 64 ? Bitboard{ 1ULL << sq, 0 } : Bitboard{ 0, 1ULL << (sq - 64) };
+			}
+
+			Bitboard operator&(const Bitboard& other) const noexcept { return Bitboard{ lo & other.lo, hi & other.hi }; }
+			Bitboard operator|(const Bitboard& other) const noexcept { return Bitboard{ lo | other.lo, hi | other.hi }; }
+			Bitboard operator~() const noexcept { return Bitboard{ ~lo, ~hi & ((1ULL << (SQUARE_NUM - 64)) - 1) }; }
+			Bitboard& operator|=(const Bitboard& other) noexcept { lo |= other.lo; hi |= other.hi; return *this; }
+			Bitboard& operator^=(const Bitboard& other) noexcept { lo ^= other.lo; hi ^= other.hi; return *this; }
+
+			bool empty() const noexcept { return (lo | hi) == 0; }
+			bool test(uint32_t sq) const noexcept { return !(*this & of(sq)).empty(); }
+
+			uint32_t popLsb() noexcept {
+				if (lo != 0) {
+					uint32_t sq = lsb(lo);
+					lo &= lo - 1;
+					return sq;
+				}
+
+				uint32_t sq = lsb(hi) + 64;
+				hi &= hi - 1;
+				return sq;
+			}
+		};
+
+		inline uint32_t rankOf(uint32_t sq) noexcept { return sq / Board::COL_NUM; }
+		inline uint32_t fileOf(uint32_t sq) noexcept { return sq % Board::COL_NUM; }
+		inline uint32_t squareOf(uint32_t rank, uint32_t file) noexcept { return rank * Board::COL_NUM + file; }
+
+		struct Tables {
+			std::array<uint8_t, SQUARE_NUM> toPadded;
+			std::array<uint8_t, Board::SQUARE_NUM> fromPadded;
+
+			// Rook: reachable squares up to and including the first blocker. Cannon: the square behind the screen.
+			uint16_t rookRank[Board::COL_NUM][1 << Board::COL_NUM];
+			uint16_t cannonRank[Board::COL_NUM][1 << Board::COL_NUM];
+			uint16_t rookFile[Board::ROW_NUM][1 << Board::ROW_NUM];
+			uint16_t cannonFile[Board::ROW_NUM][1 << Board::ROW_NUM];
+
+			// Leg/eye squares in the order up, down, left, right (knight) or up-left, up-right, down-left, down-right (bishop).
+			uint8_t knightLegs[SQUARE_NUM][4];
+			uint8_t bishopEyes[SQUARE_NUM][4];
+			Bitboard knight[SQUARE_NUM][16];
+			Bitboard bishop[SQUARE_NUM][16];
+			Bitboard advisor[SQUARE_NUM];
+			Bitboard general[SQUARE_NUM];
+			Bitboard pawn[2][SQUARE_NUM];
+
+			Tables() {
+				fromPadded.fill(NO_SQUARE);
+				for (uint32_t sq = 0; sq < SQUARE_NUM; ++sq) {
+					uint32_t padded = Board::toSquare(rankOf(sq) + Board::ROW_BEGIN, fileOf(sq) + Board::COL_BEGIN);
+					toPadded[sq] = static_cast<uint8_t>(padded);
+					fromPadded[padded] = static_cast<uint8_t>(sq);
+				}
+
+				initLineTable<Board::COL_NUM>(rookRank, cannonRank);
+				initLineTable<Board::ROW_NUM>(rookFile, cannonFile);
+
+				for (uint32_t sq = 0; sq < SQUARE_NUM; ++sq) {
+					int32_t r = static_cast<int32_t>(rankOf(sq));
+					int32_t f = static_cast<int32_t>(fileOf(sq));
+					initLeaper(sq, r, f);
+				}
+			}
+
+			template<uint32_t N>
+			static void initLineTable(uint16_t (*rook)[1 << N], uint16_t (*cannon)[1 << N]) {
+				constexpr uint32_t length = N;
+
+				for (uint32_t pos = 0; pos < length; ++pos) {
+					for (uint32_t occ = 0; occ < (1u << length); ++occ) {
+						uint16_t rookMask = 0;
+						uint16_t cannonMask = 0;
+
+						for (int32_t dir : { -1, +1 }) {
+							bool screened = false;
+
+							for (int32_t i = static_cast<int32_t>(pos) + dir; i >= 0 && i < static_cast<int32_t>(length); i += dir) {
+								bool occupied = (occ >> i) & 1;
+
+								if (!screened) {
+									rookMask |= static_cast<uint16_t>(1 << i);
+									if (occupied) {
+										screened = true;
+									}
+								}
+								else if (occupied) {
+									cannonMask |= static_cast<uint16_t>(1 << i);
+									break;
+								}
+							}
+						}
+
+						rook[pos][occ] = rookMask;
+						cannon[pos][occ] = cannonMask;
+					}
+				}
+			}
+
+			static bool onBoard(int32_t r, int32_t f) noexcept {
+				return r >= 0 && r < static_cast<int32_t>(Board::ROW_NUM) && f >= 0 && f < static_cast<int32_t>(Board::COL_NUM);
+			}
+
+			static bool inPalace(int32_t r, int32_t f, bool upPalace) noexcept {
+				return f >= 3 && f <= 5 && (upPalace ? (r >= 0 && r <= 2) : (r >= 7 && r <= 9));
+			}
+
+			static uint8_t squareOrNone(int32_t r, int32_t f) noexcept {
+				return onBoard(r, f) ? static_cast<uint8_t>(squareOf(r, f)) : static_cast<uint8_t>(NO_SQUARE);
+			}
+
+			void initLeaper(uint32_t sq, int32_t r, int32_t f) {
+				const int32_t legDr[] = { -1, +1, 0, 0 };
+				const int32_t legDf[] = { 0, 0, -1, +1 };
+				const int32_t eyeDr[] = { -1, -1, +1, +1 };
+				const int32_t eyeDf[] = { -1, +1, -1, +1 };
+				const bool upHalf = r <= 4;
+
+				for (uint32_t i = 0; i < 4; ++i) {
+					knightLegs[sq][i] = squareOrNone(r + legDr[i], f + legDf[i]);
+					bishopEyes[sq][i] = squareOrNone(r + eyeDr[i], f + eyeDf[i]);
+				}
+
+				for (uint32_t blocked = 0; blocked < 16; ++blocked) {
+					for (uint32_t i = 0; i < 4; ++i) {
+						if ((blocked >> i) & 1) {
+							continue;
+						}
+
+						// Each knight leg leads to the two squares one step sideways beyond it.
+						int32_t r1 = r + 2 * legDr[i] + legDf[i];
+						int32_t f1 = f + 2 * legDf[i] + legDr[i];
+						int32_t r2 = r + 2 * legDr[i] - legDf[i];
+						int32_t f2 = f + 2 * legDf[i] - legDr[i];
+
+						if (onBoard(r1, f1)) {
+							knight[sq][blocked] |= Bitboard::of(squareOf(r1, f1));
+						}
+
+						if (onBoard(r2, f2)) {
+							knight[sq][blocked] |= Bitboard::of(squareOf(r2, f2));
+						}
+
+						int32_t br = r + 2 * eyeDr[i];
+						int32_t bf = f + 2 * eyeDf[i];
+
+						if (onBoard(br, bf) && (br <= 4) == upHalf) {
+							bishop[sq][blocked] |= Bitboard::of(squareOf(br, bf));
+						}
+					}
+				}
+
+				for (uint32_t i = 0; i < 4; ++i) {
+					if (inPalace(r, f, upHalf) && inPalace(r + eyeDr[i], f + eyeDf[i], upHalf)) {
+						advisor[sq] |= Bitboard::of(squareOf(r + eyeDr[i], f + eyeDf[i]));
+					}
+
+					if (inPalace(r, f, upHalf) && inPalace(r + legDr[i], f + legDf[i], upHalf)) {
+						general[sq] |= Bitboard::of(squareOf(r + legDr[i], f + legDf[i]));
+					}
+				}
+
+				// UP pawns walk towards rank 9 and may step sideways once they are past the river, DOWN pawns mirror that.
+				if (onBoard(r + 1, f)) {
+					pawn[static_cast<uint32_t>(Side::UP)][sq] |= Bitboard::of(squareOf(r + 1, f));
+				}
+
+				if (onBoard(r - 1, f)) {
+					pawn[static_cast<uint32_t>(Side::DOWN)][sq] |= Bitboard::of(squareOf(r - 1, f));
+				}
+
+				for (int32_t df : { -1, +1 }) {
+					if (onBoard(r, f + df) && r >= 5) {
+						pawn[static_cast<uint32_t>(Side::UP)][sq] |= Bitboard::of(squareOf(r, f + df));
+					}
+
+					if (onBoard(r, f + df) && r <= 4) {
+						pawn[static_cast<uint32_t>(Side::DOWN)][sq] |= Bitboard::of(squareOf(r, f + df));
+					}
+				}
+			}
+		};
+
+		const Tables tables{};
+
+		class BitBoard {
+		private:
+			struct HistoryNode {
+				uint8_t from, to;
+				Piece fromP, toP;
+			};
+
+			// One extra always-empty square, so missing leg/eye squares at the edge read as empty.
+			std::array<Piece, SQUARE_NUM + 1> squares;
+			std::array<Bitboard, 14> pieceOcc;
+			std::array<Bitboard, 2> sideOcc;
+			std::array<std::array<uint16_t, Board::ROW_NUM>, 2> rankOcc;
+			std::array<std::array<uint16_t, Board::COL_NUM>, 2> fileOcc;
+			std::vector<HistoryNode> history;
+		private:
+			void put(uint32_t sq, Piece p) noexcept {
+				uint32_t s = static_cast<uint32_t>(p_util::getSide(p));
+				squares[sq] = p;
+				pieceOcc[p_util::pieceToInt32(p)] ^= Bitboard::of(sq);
+				sideOcc[s] ^= Bitboard::of(sq);
+				rankOcc[s][rankOf(sq)] ^= static_cast<uint16_t>(1 << fileOf(sq));
+				fileOcc[s][fileOf(sq)] ^= static_cast<uint16_t>(1 << rankOf(sq));
+			}
+
+			void remove(uint32_t sq) noexcept {
+				put(sq, squares[sq]);
+				squares[sq] = Piece::EE;
+			}
+		public:
+			explicit BitBoard(const Board& bd) : squares{}, pieceOcc{}, sideOcc{}, rankOcc{}, fileOcc{}, history{} {
+				squares.fill(Piece::EE);
+
+				for (uint32_t sq = 0; sq < SQUARE_NUM; ++sq) {
+					Piece p = bd.get(tables.toPadded[sq]);
+					if (p != Piece::EE) {
+						put(sq, p);
+					}
+				}
+			}
+
+			Piece get(uint32_t sq) const noexcept { return squares[sq]; }
+			const Bitboard& getPieceOcc(Piece p) const noexcept { return pieceOcc[p_util::pieceToInt32(p)]; }
+			const Bitboard& getSideOcc(Side side) const noexcept { return sideOcc[static_cast<uint32_t>(side)]; }
+
+			uint16_t getRankOcc(uint32_t rank) const noexcept { return rankOcc[0][rank] | rankOcc[1][rank]; }
+			uint16_t getRankOcc(Side side, uint32_t rank) const noexcept { return rankOcc[static_cast<uint32_t>(side)][rank]; }
+			uint16_t getFileOcc(uint32_t file) const noexcept { return fileOcc[0][file] | fileOcc[1][file]; }
+			uint16_t getFileOcc(Side side, uint32_t file) const noexcept { return fileOcc[static_cast<uint32_t>(side)][file]; }
+
+			// Moves use the padded square numbering of Board, so a Move is valid on both backends.
+			void move(const Move& m) {
+				uint32_t from = tables.fromPadded[m.from()];
+				uint32_t to = tables.fromPadded[m.to()];
+				Piece fromP = squares[from];
+				Piece toP = squares[to];
+				history.push_back(HistoryNode{ static_cast<uint8_t>(from), static_cast<uint8_t>(to), fromP, toP });
+
+				if (toP != Piece::EE) {
+					remove(to);
+				}
+				remove(from);
+				put(to, fromP);
+			}
+
+			void undo() {
+				if (history.empty()) {
+					return;
+				}
+
+				const HistoryNode node = history.back();
+				history.pop_back();
+
+				remove(node.to);
+				put(node.from, node.fromP);
+				if (node.toP != Piece::EE) {
+					put(node.to, node.toP);
+				}
+			}
+		};
+
+		inline void addTargets(Moves& moves, uint32_t from, Bitboard targets) {
+			while (!targets.empty()) {
+				moves.emplace_back(tables.toPadded[from], tables.toPadded[targets.popLsb()]);
+			}
+		}
+
+		inline void addRankTargets(Moves& moves, uint32_t from, uint32_t rank, uint32_t mask) {
+			for (; mask != 0; mask &= mask - 1) {
+				moves.emplace_back(tables.toPadded[from], tables.toPadded[squareOf(rank, lsb(mask))]);
+			}
+		}
+
+		inline void addFileTargets(Moves& moves, uint32_t from, uint32_t file, uint32_t mask) {
+			for (; mask != 0; mask &= mask - 1) {
+				moves.emplace_back(tables.toPadded[from], tables.toPadded[squareOf(lsb(mask), file)]);
+			}
+		}
+
+		inline uint32_t blockedIndex(const BitBoard& bd, const uint8_t (&legs)[4]) noexcept {
+			return (bd.get(legs[0]) != Piece::EE ? 1u : 0u)
+				| (bd.get(legs[1]) != Piece::EE ? 2u : 0u)
+				| (bd.get(legs[2]) != Piece::EE ? 4u : 0u)
+				| (bd.get(legs[3]) != Piece::EE ? 8u : 0u);
+		}
+
+		template<Side side, GenType G>
+		void genLineMoves(const BitBoard& bd, Moves& moves, uint32_t from, bool isCannon) {
+			constexpr Side enemy = p_util::getReverseSide(side);
+			uint32_t rank = rankOf(from);
+			uint32_t file = fileOf(from);
+			uint32_t rankOcc = bd.getRankOcc(rank);
+			uint32_t fileOcc = bd.getFileOcc(file);
+			uint32_t rankTargets = 0;
+			uint32_t fileTargets = 0;
+
+			if (wantsCaptures(G)) {
+				rankTargets = (isCannon ? tables.cannonRank[file][rankOcc] : tables.rookRank[file][rankOcc]) & bd.getRankOcc(enemy, rank);
+				fileTargets = (isCannon ? tables.cannonFile[rank][fileOcc] : tables.rookFile[rank][fileOcc]) & bd.getFileOcc(enemy, file);
+			}
+
+			if (wantsQuiets(G)) {
+				rankTargets |= tables.rookRank[file][rankOcc] & ~rankOcc;
+				fileTargets |= tables.rookFile[rank][fileOcc] & ~fileOcc;
+			}
+
+			addRankTargets(moves, from, rank, rankTargets & ((1u << Board::COL_NUM) - 1));
+			addFileTargets(moves, from, file, fileTargets & ((1u << Board::ROW_NUM) - 1));
+		}
+
+		template<Side side, GenType G, typename = typename std::enable_if<side == Side::UP || side == Side::DOWN, bool>::type>
+		void generate(const BitBoard& bd, Moves& moves) {
+			constexpr Side enemy = p_util::getReverseSide(side);
+			constexpr uint32_t s = static_cast<uint32_t>(side);
+			constexpr uint32_t base = side == Side::UP ? p_util::pieceToInt32(Piece::UP) : p_util::pieceToInt32(Piece::DP);
+			const Bitboard empty = ~(bd.getSideOcc(side) | bd.getSideOcc(enemy));
+			const Bitboard targetMask = (wantsQuiets(G) ? empty : Bitboard{}) | (wantsCaptures(G) ? bd.getSideOcc(enemy) : Bitboard{});
+			Bitboard bb;
+
+			bb = bd.getPieceOcc(static_cast<Piece>(base + 0));
+			while (!bb.empty()) {
+				uint32_t from = bb.popLsb();
+				addTargets(moves, from, tables.pawn[s][from] & targetMask);
+			}
+
+			bb = bd.getPieceOcc(static_cast<Piece>(base + 1));
+			while (!bb.empty()) {
+				genLineMoves<side, G>(bd, moves, bb.popLsb(), true);
+			}
+
+			bb = bd.getPieceOcc(static_cast<Piece>(base + 2));
+			while (!bb.empty()) {
+				genLineMoves<side, G>(bd, moves, bb.popLsb(), false);
+			}
+
+			bb = bd.getPieceOcc(static_cast<Piece>(base + 3));
+			while (!bb.empty()) {
+				uint32_t from = bb.popLsb();
+				addTargets(moves, from, tables.knight[from][blockedIndex(bd, tables.knightLegs[from])] & targetMask);
+			}
+
+			bb = bd.getPieceOcc(static_cast<Piece>(base + 4));
+			while (!bb.empty()) {
+				uint32_t from = bb.popLsb();
+				addTargets(moves, from, tables.bishop[from][blockedIndex(bd, tables.bishopEyes[from])] & targetMask);
+			}
+
+			bb = bd.getPieceOcc(static_cast<Piece>(base + 5));
+			while (!bb.empty()) {
+				uint32_t from = bb.popLsb();
+				addTargets(moves, from, tables.advisor[from] & targetMask);
+			}
+
+			bb = bd.getPieceOcc(static_cast<Piece>(base + 6));
+			while (!bb.empty()) {
+				uint32_t from = bb.popLsb();
+				addTargets(moves, from, tables.general[from] & targetMask);
+
+				// Flying general: the first piece up/down the file is the enemy general.
+				Bitboard enemyGeneral = bd.getPieceOcc(static_cast<Piece>(p_util::pieceToInt32(side == Side::UP ? Piece::DG : Piece::UG)));
+				if (!enemyGeneral.empty()) {
+					uint32_t enemySq = enemyGeneral.popLsb();
+					uint32_t file = fileOf(from);
+
+					if (wantsCaptures(G) && fileOf(enemySq) == file && ((tables.rookFile[rankOf(from)][bd.getFileOcc(file)] >> rankOf(enemySq)) & 1)) {
+						moves.emplace_back(tables.toPadded[from], tables.toPadded[enemySq]);
+					}
+				}
+			}
+		}
+	};
+
+	template<Side side, GenType G = GenType::ALL, typename = typename std::enable_if<side == Side::UP || side == Side::DOWN, bool>::type>
+	void genMoves(const bitboard::BitBoard& bd, Moves& moves) {
+		bitboard::generate<side, G>(bd, moves);
+	}
+
+	/*
+		Counts the leaf nodes of the move tree, the standard check and benchmark for move generators. Works with
+		either board backend.
+	*/
+	template<Side side, typename BoardT>
+	uint64_t perft(BoardT& bd, uint32_t depth) {
+		Moves moves;
+		genMoves<side>(bd, moves);
+
+		if (depth <= 1) {
+			return depth == 1 ? moves.size() : 1;
+		}
+
+		uint64_t nodes = 0;
+		for (const auto& m : moves) {
+			bd.move(m);
+			nodes += perft<p_util::getReverseSide(side)>(bd, depth - 1);
+			bd.undo();
+		}
+
+		return nodes;
+	}
+
+	// A header written by "gchess tune" can replace the hand-written tables.
+#ifdef GCHESS_VALUES_HEADER
+#include GCHESS_VALUES_HEADER
+#else
+	namespace value {
+		constexpr int32_t pieceValueMap[] = {
+			-20, -50, -100, -50, -10, -10, -10000,
+			+20, +50, +100, +50, +10, +10, +10000,
+			  0,   0
+		};
+
+		constexpr int32_t posValueMap[][Board::ROW_NUM][Board::COL_NUM] = {
+			// UP
+			{
 				{   0,   0,   0,   0,   0,   0,   0,   0,   0 },
 				{   0,   0,   0,   0,   0,   0,   0,   0,   0 },
 				{   0,   0,   0,   0,   0,   0,   0,   0,   0 },
@@ -728,8 +2479,8 @@ namespace g_chess {
 				{ 0, 0, 0, 0, 0, 0, 0, 0, 0 },
 				{ 0, 0, 0, 0, 0, 0, 0, 0, 0 },
 				{ 0, 0, 0, 0, 0, 0, 0, 0, 0 },
-				{ 0, 0, 0, 0, 3, 0, 0, 0, 0 },
 				{ 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+				{ 0, 0, 0, 0, 3, 0, 0, 0, 0 },
 				{ 0, 0, 0, 0, 0, 0, 0, 0, 0 }
 			},
 			// DG
@@ -758,229 +2509,4056 @@ namespace g_chess {
 				{ 0, 0, 0, 0, 0, 0, 0, 0, 0 },
 				{ 0, 0, 0, 0, 0, 0, 0, 0, 0 }
 			}
-		};
+		};
+	};
+#endif
+
+	inline int32_t getPieceValue(Piece p) {
+		return value::pieceValueMap[p_util::pieceToInt32(p)];
+	}
+
+	inline int32_t getPiecePosValue(Piece p, const Pos& pos) {
+		return value::posValueMap[p_util::pieceToInt32(p)][pos.row - Board::SINGLE_ROW_PADDING][pos.col - Board::SINGLE_COL_PADDING];
+	}
+
+	/*
+		Define GCHESS_CHECK_EVAL to cross-check the incremental score against a full board scan at every leaf.
+	*/
+	int32_t calcBoardScore(const Board& bd) {
+#ifdef GCHESS_CHECK_EVAL
+		assert(bd.getScore() == bd.calcScore());
+#endif
+		return bd.getScore();
+	}
+
+	constexpr int32_t MAX_VALUE = std::numeric_limits<int32_t>::max();
+	// Symmetric, so a score can always be negated.
+	constexpr int32_t MIN_VALUE = -MAX_VALUE;
+
+	/*
+		Score of the side to move when it has lost, the ply is added so a faster win scores higher. Mate scores are
+		stored in the transposition table relative to the node instead of the root.
+	*/
+	constexpr int32_t MATE_VALUE = 1000000;
+	constexpr int32_t MATE_BOUND = MATE_VALUE - 1000;
+	// Score of a repetition won by the rules against perpetual check and chase, above any material but below mate.
+	constexpr int32_t BAN_VALUE = MATE_BOUND - 1000;
+
+	inline int32_t scoreToTT(int32_t score, uint32_t ply) noexcept {
+		return score >= MATE_BOUND ? score + static_cast<int32_t>(ply) : score <= -MATE_BOUND ? score - static_cast<int32_t>(ply) : score;
+	}
+
+	inline int32_t scoreFromTT(int32_t score, uint32_t ply) noexcept {
+		return score >= MATE_BOUND ? score - static_cast<int32_t>(ply) : score <= -MATE_BOUND ? score + static_cast<int32_t>(ply) : score;
+	}
+
+	enum class Bound : uint8_t {
+		NONE, EXACT, LOWER, UPPER
+	};
+
+	struct TTEntry {
+		uint64_t key;
+		Move bestMove;
+		int32_t score;
+		uint8_t depth;
+		Bound bound;
+	};
+
+	/*
+		Transposition table shared by all search threads without a lock. Entries are 16 bytes, two atomic words
+		holding the packed entry and key ^ entry: an entry torn by two racing writers no longer xors back to the probed
+		key and reads as a miss. Four entries make a 64-byte bucket on its own cache line, a key only ever looks at
+		its bucket.
+
+		Within a bucket, an entry of the same position is refreshed unless it was searched deeper in this search,
+		otherwise the entry with the lowest depth, counting older searches as shallower, is replaced.
+	*/
+	class TransTable {
+	public:
+		constexpr static size_t DEFAULT_SIZE_MB = 16;
+		constexpr static uint32_t BUCKET_SIZE = 4;
+		constexpr static uint32_t AGE_NUM = 64;
+	private:
+		struct Entry {
+			std::atomic<uint64_t> keyXorData;
+			std::atomic<uint64_t> data;
+		};
+
+		struct alignas(64) Bucket {
+			Entry entries[BUCKET_SIZE];
+		};
+
+		static_assert(sizeof(Bucket) == 64, "a bucket must fill exactly one cache line");
+
+		Bucket* buckets;
+		size_t bucketNum;
+		size_t allocSize;
+		uint32_t age;
+	private:
+		// data word: move in bits 0-15, score in 16-47, depth in 48-55, bound in 56-57 and age in 58-63.
+		static uint64_t pack(const Move& bestMove, int32_t score, uint32_t depth, Bound bound, uint32_t age) noexcept {
+			return static_cast<uint64_t>(bestMove.data)
+				| (static_cast<uint64_t>(static_cast<uint32_t>(score)) << 16)
+				| (static_cast<uint64_t>(std::min(depth, 255u)) << 48)
+				| (static_cast<uint64_t>(bound) << 56)
+				| (static_cast<uint64_t>(age) << 58);
+		}
+
+		static uint32_t depthOf(uint64_t data) noexcept { return static_cast<uint32_t>((data >> 48) & 0xFF); }
+		static Bound boundOf(uint64_t data) noexcept { return static_cast<Bound>((data >> 56) & 0x3); }
+		static uint32_t ageOf(uint64_t data) noexcept { return static_cast<uint32_t>(data >> 58); }
+
+		static void unpack(uint64_t key, uint64_t data, TTEntry& entry) noexcept {
+			entry.key = key;
+			entry.bestMove.data = static_cast<uint16_t>(data & 0xFFFF);
+			entry.score = static_cast<int32_t>(static_cast<uint32_t>(data >> 16));
+			entry.depth = static_cast<uint8_t>(depthOf(data));
+			entry.bound = boundOf(data);
+		}
+
+		// Depth an entry is worth keeping for, every search since it was written costs it 8 plies.
+		int32_t worth(uint64_t data) const noexcept {
+			uint32_t ageDistance = (age - ageOf(data)) & (AGE_NUM - 1);
+			return static_cast<int32_t>(depthOf(data)) - 8 * static_cast<int32_t>(ageDistance);
+		}
+
+		const Bucket& bucketOf(uint64_t key) const noexcept {
+			return buckets[key & (bucketNum - 1)];
+		}
+
+		Bucket& bucketOf(uint64_t key) noexcept {
+			return buckets[key & (bucketNum - 1)];
+		}
+
+		/*
+			Large tables are 2MB aligned and, on Linux, advised to be backed by transparent huge pages so the random
+			probes don't miss the TLB on every access. Elsewhere it is a plain cache-line aligned allocation.
+		*/
+		static void* allocate(size_t size) {
+			void* ptr = nullptr;
+#if defined(_WIN32)
+			ptr = _aligned_malloc(size, 64);
+#else
+			const size_t alignment = size >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : 64;
+			if (posix_memalign(&ptr, alignment, size) != 0) {
+				ptr = nullptr;
+			}
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+			if (ptr != nullptr && size >= HUGE_PAGE_SIZE) {
+				madvise(ptr, size, MADV_HUGEPAGE);
+			}
+#endif
+#endif
+			if (ptr == nullptr) {
+				throw std::bad_alloc{};
+			}
+
+			return ptr;
+		}
+
+		static void deallocate(void* ptr) noexcept {
+#if defined(_WIN32)
+			_aligned_free(ptr);
+#else
+			free(ptr);
+#endif
+		}
+
+		constexpr static size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+	public:
+		// The bucket count is rounded down to a power of two, so the bucket is just the low bits of the key.
+		explicit TransTable(size_t sizeMb = DEFAULT_SIZE_MB) : buckets(nullptr), bucketNum(0), allocSize(0), age(0) {
+			resize(sizeMb);
+		}
+
+		TransTable(const TransTable&) = delete;
+		TransTable& operator=(const TransTable&) = delete;
+
+		~TransTable() {
+			deallocate(buckets);
+		}
+
+		void resize(size_t sizeMb) {
+			size_t num = 1;
+			while (num * 2 * sizeof(Bucket) <= std::max<size_t>(sizeMb, 1) * 1024 * 1024) {
+				num *= 2;
+			}
+
+			void* memory = allocate(num * sizeof(Bucket));
+			deallocate(buckets);
+
+			buckets = static_cast<Bucket*>(memory);
+			bucketNum = num;
+			allocSize = num * sizeof(Bucket);
+			for (size_t i = 0; i < bucketNum; ++i) {
+				new (&buckets[i]) Bucket;
+			}
+
+			clear();
+		}
+
+		size_t sizeInBytes() const noexcept {
+			return allocSize;
+		}
+
+		void clear() {
+			age = 0;
+			for (size_t i = 0; i < bucketNum; ++i) {
+				for (auto& entry : buckets[i].entries) {
+					entry.keyXorData.store(0, std::memory_order_relaxed);
+					entry.data.store(0, std::memory_order_relaxed);
+				}
+			}
+		}
+
+		// Permille of the entries written by the current search, sampled from the first 250 buckets.
+		uint32_t hashfull() const noexcept {
+			const size_t sampled = std::min<size_t>(bucketNum, 250);
+			uint32_t used = 0;
+
+			for (size_t i = 0; i < sampled; ++i) {
+				for (const auto& e : buckets[i].entries) {
+					uint64_t data = e.data.load(std::memory_order_relaxed);
+					used += boundOf(data) != Bound::NONE && ageOf(data) == age;
+				}
+			}
+
+			return static_cast<uint32_t>(used * 1000 / (sampled * BUCKET_SIZE));
+		}
+
+		// Called once per search, entries of older searches become cheaper to replace.
+		void newSearch() noexcept {
+			age = (age + 1) & (AGE_NUM - 1);
+		}
+
+		void prefetch(uint64_t key) const noexcept {
+#if defined(_MSC_VER)
+			_mm_prefetch(reinterpret_cast<const char*>(&bucketOf(key)), _MM_HINT_T0);
+#else
+			__builtin_prefetch(&bucketOf(key));
+#endif
+		}
+
+		bool probe(uint64_t key, TTEntry& entry) const noexcept {
+			for (const auto& e : bucketOf(key).entries) {
+				uint64_t data = e.data.load(std::memory_order_relaxed);
+				uint64_t keyXorData = e.keyXorData.load(std::memory_order_relaxed);
+
+				if ((keyXorData ^ data) == key && boundOf(data) != Bound::NONE) {
+					unpack(key, data, entry);
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		void store(uint64_t key, uint32_t depth, Bound bound, int32_t score, Move bestMove) noexcept {
+			Bucket& bucket = bucketOf(key);
+			Entry* victim = &bucket.entries[0];
+			uint64_t victimData = victim->data.load(std::memory_order_relaxed);
+			bool samePosition = false;
+
+			for (auto& e : bucket.entries) {
+				uint64_t data = e.data.load(std::memory_order_relaxed);
+				uint64_t keyXorData = e.keyXorData.load(std::memory_order_relaxed);
+
+				if ((keyXorData ^ data) == key) {
+					victim = &e;
+					victimData = data;
+					samePosition = true;
+					break;
+				}
+
+				if (worth(data) < worth(victimData)) {
+					victim = &e;
+					victimData = data;
+				}
+			}
+
+			if (samePosition) {
+				if (bound != Bound::EXACT && ageOf(victimData) == age && depth + 2 < depthOf(victimData)) {
+					return;
+				}
+
+				// Keep the old move when this search didn't find one, it's still the best guess for ordering.
+				if (bestMove == Move{}) {
+					bestMove.data = static_cast<uint16_t>(victimData & 0xFFFF);
+				}
+			}
+
+			uint64_t data = pack(bestMove, score, depth, bound, age);
+			victim->keyXorData.store(key ^ data, std::memory_order_relaxed);
+			victim->data.store(data, std::memory_order_relaxed);
+		}
+	};
+
+	inline void prefetchTT(const TransTable* tt, uint64_t key) noexcept {
+		tt->prefetch(key);
+	}
+
+	/*
+		A file mapped into memory read-only, so opening it reads nothing and only the pages that are used get loaded.
+		Without mmap, on Windows, the file is read into memory instead.
+	*/
+	class MappedFile {
+	private:
+		const char* contents;
+		size_t length;
+		void* mapping;
+		std::vector<char> buffer;
+	public:
+		MappedFile() : contents(nullptr), length(0), mapping(nullptr), buffer{} {}
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		~MappedFile() {
+			close();
+		}
+
+		bool open(const std::string& fileName) {
+			close();
+
+#if defined(_WIN32)
+			std::ifstream in{ fileName, std::ios::binary };
+			if (!in) {
+				return false;
+			}
+			buffer.assign(std::istreambuf_iterator<char>{ in }, std::istreambuf_iterator<char>{});
+			contents = buffer.data();
+			length = buffer.size();
+#else
+			int fd = ::open(fileName.c_str(), O_RDONLY);
+			struct stat st;
+			if (fd < 0) {
+				return false;
+			}
+			if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+				::close(fd);
+				return false;
+			}
+
+			void* ptr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+			::close(fd);
+			if (ptr == MAP_FAILED) {
+				return false;
+			}
+			mapping = ptr;
+			contents = static_cast<const char*>(ptr);
+			length = static_cast<size_t>(st.st_size);
+#endif
+			return true;
+		}
+
+		void close() {
+#if !defined(_WIN32)
+			if (mapping != nullptr) {
+				munmap(mapping, length);
+			}
+#endif
+			std::vector<char>{}.swap(buffer);
+			contents = nullptr;
+			length = 0;
+			mapping = nullptr;
+		}
+
+		const char* data() const noexcept {
+			return contents;
+		}
+
+		size_t size() const noexcept {
+			return length;
+		}
+	};
+
+	/*
+		Endgame tablebases for positions with few pieces, built by retrograde analysis ("gchess tbgen") and probed by
+		the search. A table holds one material signature, named by the pieces besides the generals, DOWN's then UP's:
+		"RvA" is a rook against an advisor, "v" the bare generals. Only the orientation with the stronger side DOWN is
+		stored, a position with the colors the other way round is looked up turned upside down.
+
+		Every position gets a byte: DRAW, BROKEN for impossible positions, or dtm + 1 with dtm the number of plies to
+		mate with best play. An odd dtm is a win for the side to move, an even one a loss, 0 being mated or
+		stalemated right now. Repetitions count as draws, the rules against perpetual check and chasing aren't
+		modelled, so a drawn entry can be a loss by those rules.
+
+		The index is the square of every piece among the squares its type can stand on, so generals, advisors and
+		bishops cost 9, 5 and 7 instead of 90. The file is cut into blocks of BLOCK_SIZE entries, each run length
+		encoded on its own, and a probe maps the file and decodes part of one block. Little endian:
+			char[4] "GCTB", uint32 version (1), uint64 entry count, uint32 block size, uint32 block count
+			uint32 blockOffsets[block count + 1], from the start of the block data
+			block data, runs of (uint8 value, LEB128 length)
+	*/
+	namespace tablebase {
+		// Pieces besides the two generals a table can have.
+		constexpr uint32_t MAX_EXTRA_PIECES = 3;
+		constexpr uint32_t MAX_PIECES = 2 + MAX_EXTRA_PIECES;
+		constexpr uint32_t BLOCK_SIZE = 4096;
+		constexpr uint32_t FILE_VERSION = 1;
+		constexpr size_t HEADER_SIZE = 24;
+
+		constexpr uint8_t DRAW = 0;
+		constexpr uint8_t BROKEN = 255;
+		constexpr uint32_t MAX_DTM = 253;
+
+		inline bool isWin(uint8_t value) noexcept { return value != DRAW && value != BROKEN && (value - 1) % 2 == 1; }
+		inline bool isLoss(uint8_t value) noexcept { return value != DRAW && value != BROKEN && (value - 1) % 2 == 0; }
+		inline uint32_t dtmOf(uint8_t value) noexcept { return value - 1u; }
+
+		constexpr uint32_t SQUARE_NUM = Board::ROW_NUM * Board::COL_NUM;
+
+		inline uint32_t mirror(uint32_t sq) noexcept {
+			return (Board::ROW_NUM - 1 - sq / Board::COL_NUM) * Board::COL_NUM + sq % Board::COL_NUM;
+		}
+
+		// The squares a piece of each side and type can stand on, in the 90-square numbering of Board::toSquare90.
+		struct SquareSets {
+			struct Set {
+				std::array<uint8_t, SQUARE_NUM> squares;
+				std::array<int8_t, SQUARE_NUM> indexOf;
+				uint32_t size;
+			};
+
+			std::array<std::array<Set, 7>, 2> sets;
+
+			// rank counts from the own back rank.
+			static bool canStand(Type type, uint32_t rank, uint32_t file) noexcept {
+				switch (type) {
+				case Type::GENERAL: return rank <= 2 && file >= 3 && file <= 5;
+				case Type::ADVISOR: return rank <= 2 && file >= 3 && file <= 5 && (rank + file) % 2 == 1;
+				case Type::BISHOP: return rank <= 4 && rank % 2 == 0 && file % 2 == 0 && (rank / 2 + file / 2) % 2 == 1;
+				case Type::PAWN: return rank >= 3 && (rank >= 5 || file % 2 == 0);
+				default: return true;
+				}
+			}
+
+			SquareSets() : sets{} {
+				for (uint32_t s = 0; s < 2; ++s) {
+					for (uint32_t t = 0; t < 7; ++t) {
+						Set& set = sets[s][t];
+						set.indexOf.fill(-1);
+
+						for (uint32_t sq = 0; sq < SQUARE_NUM; ++sq) {
+							uint32_t row = sq / Board::COL_NUM;
+							uint32_t rank = static_cast<Side>(s) == Side::UP ? row : Board::ROW_NUM - 1 - row;
+
+							if (canStand(static_cast<Type>(t), rank, sq % Board::COL_NUM)) {
+								set.indexOf[sq] = static_cast<int8_t>(set.size);
+								set.squares[set.size++] = static_cast<uint8_t>(sq);
+							}
+						}
+					}
+				}
+			}
+
+			const Set& of(Side side, Type type) const noexcept {
+				return sets[static_cast<uint32_t>(side)][static_cast<uint32_t>(type)];
+			}
+		};
+
+		const SquareSets squareSets{};
+
+		// Rough piece strength, orders the pieces of a signature.
+		constexpr uint32_t strengthOf(Type type) noexcept {
+			return type == Type::ROOK ? 6 : type == Type::KNIGHT ? 5 : type == Type::CANNON ? 4 : type == Type::PAWN ? 3 : type == Type::ADVISOR ? 2 : 1;
+		}
+
+		/*
+			The pieces besides the generals of each side, strongest first. A table is stored for the canonical
+			orientation only, the one where DOWN's pieces are the stronger by strengthOf, ties broken by count and kind.
+		*/
+		struct Signature {
+			std::array<std::array<Type, MAX_EXTRA_PIECES>, 2> types;
+			std::array<uint32_t, 2> counts;
+
+			Signature() : types{}, counts{} {}
+
+			uint32_t sideCode(Side side) const noexcept {
+				uint32_t s = static_cast<uint32_t>(side), code = 0;
+				for (uint32_t i = 0; i < counts[s]; ++i) {
+					code = code * 8 + strengthOf(types[s][i]);
+				}
+				return code;
+			}
+
+			// Unique per signature, the key of the loaded tables.
+			uint32_t code() const noexcept {
+				return (sideCode(Side::DOWN) << 9) | sideCode(Side::UP);
+			}
+
+			uint32_t strength(Side side) const noexcept {
+				uint32_t sum = 0;
+				for (uint32_t i = 0; i < counts[static_cast<uint32_t>(side)]; ++i) {
+					sum += strengthOf(types[static_cast<uint32_t>(side)][i]);
+				}
+				return sum;
+			}
+
+			bool isCanonical() const noexcept {
+				uint32_t up = static_cast<uint32_t>(Side::UP), down = static_cast<uint32_t>(Side::DOWN);
+				if (strength(Side::DOWN) != strength(Side::UP)) {
+					return strength(Side::DOWN) > strength(Side::UP);
+				}
+				return counts[down] != counts[up] ? counts[down] > counts[up] : sideCode(Side::DOWN) >= sideCode(Side::UP);
+			}
+
+			void add(Side side, Type type) noexcept {
+				auto& list = types[static_cast<uint32_t>(side)];
+				uint32_t i = counts[static_cast<uint32_t>(side)]++;
+				for (; i > 0 && strengthOf(list[i - 1]) < strengthOf(type); --i) {
+					list[i] = list[i - 1];
+				}
+				list[i] = type;
+			}
+
+			Signature flipped() const {
+				Signature sig;
+				for (Side side : { Side::UP, Side::DOWN }) {
+					for (uint32_t i = 0; i < counts[static_cast<uint32_t>(side)]; ++i) {
+						sig.add(p_util::getReverseSide(side), types[static_cast<uint32_t>(side)][i]);
+					}
+				}
+				return sig;
+			}
+
+			Signature canonical() const {
+				return isCanonical() ? *this : flipped();
+			}
+
+			std::string name() const {
+				std::string str;
+				for (Side side : { Side::DOWN, Side::UP }) {
+					for (uint32_t i = 0; i < counts[static_cast<uint32_t>(side)]; ++i) {
+						str += fen::charOf(static_cast<Piece>(p_util::pieceToInt32(Piece::DP) + static_cast<uint32_t>(types[static_cast<uint32_t>(side)][i])));
+					}
+					if (side == Side::DOWN) {
+						str += 'v';
+					}
+				}
+				return str;
+			}
+
+			// "RvA", "Rv" or just "R".
+			static bool parse(const std::string& str, Signature& sig) {
+				sig = Signature{};
+				Side side = Side::DOWN;
+
+				for (char c : str) {
+					if (c == 'v' && side == Side::DOWN) {
+						side = Side::UP;
+						continue;
+					}
+
+					Piece p = fen::pieceOf(static_cast<char>(std::toupper(static_cast<unsigned char>(c))));
+					if (p == Piece::EO || p_util::getType(p) == Type::GENERAL || sig.counts[0] + sig.counts[1] == MAX_EXTRA_PIECES) {
+						return false;
+					}
+					sig.add(side, p_util::getType(p));
+				}
+
+				return true;
+			}
+
+			// Pieces in index order: the DOWN general, the UP general, DOWN's pieces and UP's pieces.
+			uint32_t pieceNum() const noexcept {
+				return 2 + counts[0] + counts[1];
+			}
+
+			Piece pieceAt(uint32_t slot) const noexcept {
+				const uint32_t down = static_cast<uint32_t>(Side::DOWN), up = static_cast<uint32_t>(Side::UP);
+				if (slot < 2) {
+					return slot == 0 ? Piece::DG : Piece::UG;
+				}
+				if (slot - 2 < counts[down]) {
+					return static_cast<Piece>(p_util::pieceToInt32(Piece::DP) + static_cast<uint32_t>(types[down][slot - 2]));
+				}
+				return static_cast<Piece>(p_util::pieceToInt32(Piece::UP) + static_cast<uint32_t>(types[up][slot - 2 - counts[down]]));
+			}
+
+			// Entries per side to move.
+			uint64_t positionNum() const noexcept {
+				uint64_t n = 1;
+				for (uint32_t slot = 0; slot < pieceNum(); ++slot) {
+					Piece p = pieceAt(slot);
+					n *= squareSets.of(p_util::getSide(p), p_util::getType(p)).size;
+				}
+				return n;
+			}
+
+			uint64_t size() const noexcept {
+				return 2 * positionNum();
+			}
+		};
+
+		struct PieceSquare {
+			Piece piece;
+			uint32_t sq;
+		};
+
+		/*
+			The canonical table and the entry of a position given by its pieces, turned upside down when needed. False
+			when it can't be in a table: too many pieces, a missing general or a piece where its type can't stand.
+		*/
+		inline bool locate(const PieceSquare* pieces, uint32_t n, Side stm, Signature& sig, uint64_t& index) {
+			if (n < 2 || n > MAX_PIECES) {
+				return false;
+			}
+
+			sig = Signature{};
+			for (uint32_t i = 0; i < n; ++i) {
+				if (p_util::getType(pieces[i].piece) != Type::GENERAL) {
+					sig.add(p_util::getSide(pieces[i].piece), p_util::getType(pieces[i].piece));
+				}
+			}
+
+			const bool flip = !sig.isCanonical();
+			if (flip) {
+				sig = sig.flipped();
+				stm = p_util::getReverseSide(stm);
+			}
+
+			// Each slot takes the first unused piece that fits it, equal pieces may come in any order.
+			uint32_t used = 0;
+			index = 0;
+			for (uint32_t slot = 0; slot < sig.pieceNum(); ++slot) {
+				const Piece want = sig.pieceAt(slot);
+				uint32_t i = 0;
+
+				for (; i < n; ++i) {
+					Piece p = pieces[i].piece;
+					Piece actual = flip ? static_cast<Piece>((p_util::pieceToInt32(p) + 7) % 14) : p;
+					if (!(used & (1u << i)) && actual == want) {
+						break;
+					}
+				}
+
+				if (i == n) {
+					return false;
+				}
+
+				used |= 1u << i;
+				const auto& set = squareSets.of(p_util::getSide(want), p_util::getType(want));
+				int32_t setIndex = set.indexOf[flip ? mirror(pieces[i].sq) : pieces[i].sq];
+				if (setIndex < 0) {
+					return false;
+				}
+				index = index * set.size + static_cast<uint32_t>(setIndex);
+			}
+
+			index += stm == Side::DOWN ? sig.positionNum() : 0;
+			return true;
+		}
+
+		// The inverse of locate, false when two pieces share a square.
+		inline bool decode(const Signature& sig, uint64_t index, std::array<PieceSquare, MAX_PIECES>& pieces, Side& stm) {
+			const uint64_t positionNum = sig.positionNum();
+			stm = index >= positionNum ? Side::DOWN : Side::UP;
+			index %= positionNum;
+
+			std::array<bool, SQUARE_NUM> occupied{};
+			for (uint32_t slot = sig.pieceNum(); slot-- > 0;) {
+				Piece p = sig.pieceAt(slot);
+				const auto& set = squareSets.of(p_util::getSide(p), p_util::getType(p));
+				uint32_t sq = set.squares[index % set.size];
+				index /= set.size;
+
+				if (occupied[sq]) {
+					return false;
+				}
+				occupied[sq] = true;
+				pieces[slot] = PieceSquare{ p, sq };
+			}
+
+			return true;
+		}
+
+		// One table file, mapped and probed in place.
+		class Table {
+		private:
+			MappedFile file;
+			uint64_t entryNum;
+			uint32_t blockNum;
+			const uint32_t* offsets;
+			const uint8_t* blocks;
+		public:
+			Table() : file{}, entryNum(0), blockNum(0), offsets(nullptr), blocks(nullptr) {}
+
+			bool open(const std::string& fileName, uint64_t expectedSize) {
+				uint32_t version = 0, blockSize = 0;
+
+				if (!file.open(fileName) || file.size() < HEADER_SIZE) {
+					return false;
+				}
+
+				const char* data = file.data();
+				std::memcpy(&version, data + 4, sizeof(version));
+				std::memcpy(&entryNum, data + 8, sizeof(entryNum));
+				std::memcpy(&blockSize, data + 16, sizeof(blockSize));
+				std::memcpy(&blockNum, data + 20, sizeof(blockNum));
+
+				const size_t dataBegin = HEADER_SIZE + (static_cast<size_t>(blockNum) + 1) * sizeof(uint32_t);
+				if (std::memcmp(data, "GCTB", 4) != 0 || version != FILE_VERSION || entryNum != expectedSize || blockSize != BLOCK_SIZE
+					|| blockNum != (entryNum + BLOCK_SIZE - 1) / BLOCK_SIZE || file.size() < dataBegin) {
+					file.close();
+					return false;
+				}
+
+				offsets = reinterpret_cast<const uint32_t*>(data + HEADER_SIZE);
+				blocks = reinterpret_cast<const uint8_t*>(data + dataBegin);
+				if (offsets[blockNum] != file.size() - dataBegin) {
+					file.close();
+					return false;
+				}
+
+				return true;
+			}
+
+			uint8_t get(uint64_t index) const noexcept {
+				const uint8_t* p = blocks + offsets[index / BLOCK_SIZE];
+				uint64_t pos = index % BLOCK_SIZE;
+
+				while (true) {
+					uint8_t value = *p++;
+					uint64_t length = 0;
+					for (uint32_t shift = 0; ; shift += 7) {
+						length |= static_cast<uint64_t>(*p & 0x7F) << shift;
+						if ((*p++ & 0x80) == 0) {
+							break;
+						}
+					}
+
+					if (pos < length) {
+						return value;
+					}
+					pos -= length;
+				}
+			}
+
+			static bool write(const std::string& fileName, const std::vector<uint8_t>& values) {
+				const uint64_t entryNum = values.size();
+				const uint32_t blockNum = static_cast<uint32_t>((entryNum + BLOCK_SIZE - 1) / BLOCK_SIZE);
+				const uint32_t version = FILE_VERSION, blockSize = BLOCK_SIZE;
+				std::vector<uint32_t> offsets{ 0 };
+				std::vector<uint8_t> data;
+
+				for (uint64_t begin = 0; begin < entryNum; begin += BLOCK_SIZE) {
+					const uint64_t end = std::min<uint64_t>(begin + BLOCK_SIZE, entryNum);
+
+					for (uint64_t i = begin; i < end;) {
+						uint64_t runEnd = i;
+						while (runEnd < end && values[runEnd] == values[i]) {
+							++runEnd;
+						}
+
+						data.push_back(values[i]);
+						for (uint64_t length = runEnd - i; ; length >>= 7) {
+							data.push_back(static_cast<uint8_t>((length & 0x7F) | (length >= 0x80 ? 0x80 : 0)));
+							if (length < 0x80) {
+								break;
+							}
+						}
+						i = runEnd;
+					}
+
+					offsets.push_back(static_cast<uint32_t>(data.size()));
+				}
+
+				std::ofstream out{ fileName, std::ios::binary };
+				out.write("GCTB", 4);
+				out.write(reinterpret_cast<const char*>(&version), sizeof(version));
+				out.write(reinterpret_cast<const char*>(&entryNum), sizeof(entryNum));
+				out.write(reinterpret_cast<const char*>(&blockSize), sizeof(blockSize));
+				out.write(reinterpret_cast<const char*>(&blockNum), sizeof(blockNum));
+				out.write(reinterpret_cast<const char*>(offsets.data()), static_cast<std::streamsize>(offsets.size() * sizeof(uint32_t)));
+				out.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+
+				return static_cast<bool>(out);
+			}
+		};
+
+		inline std::string fileNameOf(const std::string& dir, const Signature& sig) {
+			return dir + "/" + sig.name() + ".gctb";
+		}
+
+		// Every canonical signature of up to MAX_EXTRA_PIECES pieces besides the generals.
+		inline std::vector<Signature> allSignatures() {
+			std::vector<Signature> sides{ Signature{} };
+			const Type types[] = { Type::PAWN, Type::CANNON, Type::ROOK, Type::KNIGHT, Type::BISHOP, Type::ADVISOR };
+
+			// The piece sets of one side, each built strongest first so every set comes once.
+			for (size_t i = 0; i < sides.size(); ++i) {
+				const Signature base = sides[i];
+				const uint32_t count = base.counts[static_cast<uint32_t>(Side::DOWN)];
+				if (count == MAX_EXTRA_PIECES) {
+					continue;
+				}
+
+				for (Type t : types) {
+					if (count == 0 || strengthOf(base.types[static_cast<uint32_t>(Side::DOWN)][count - 1]) >= strengthOf(t)) {
+						Signature next = base;
+						next.add(Side::DOWN, t);
+						sides.push_back(next);
+					}
+				}
+			}
+
+			std::vector<Signature> result;
+			for (const auto& down : sides) {
+				for (const auto& up : sides) {
+					const uint32_t d = static_cast<uint32_t>(Side::DOWN);
+					if (down.counts[d] + up.counts[d] > MAX_EXTRA_PIECES) {
+						continue;
+					}
+
+					Signature sig = down;
+					for (uint32_t i = 0; i < up.counts[d]; ++i) {
+						sig.add(Side::UP, up.types[d][i]);
+					}
+					if (sig.isCanonical()) {
+						result.push_back(sig);
+					}
+				}
+			}
+
+			return result;
+		}
+
+		/*
+			The tables of a directory, probed by the search for positions of at most getMaxPieces() pieces. Scores are
+			mate scores like the search's own, the win or loss is ply + dtm plies from the root.
+		*/
+		class Tablebases {
+		private:
+			std::unordered_map<uint32_t, std::unique_ptr<Table>> tables;
+			uint32_t maxPieces;
+		public:
+			Tablebases() : tables{}, maxPieces(0) {}
+
+			// Returns the number of tables found.
+			size_t load(const std::string& dir) {
+				for (const auto& sig : allSignatures()) {
+					std::unique_ptr<Table> table{ new Table{} };
+					if (table->open(fileNameOf(dir, sig), sig.size())) {
+						tables[sig.code()] = std::move(table);
+						maxPieces = std::max(maxPieces, sig.pieceNum());
+					}
+				}
+
+				return tables.size();
+			}
+
+			uint32_t getMaxPieces() const noexcept {
+				return maxPieces;
+			}
+
+			bool probe(const Board& bd, Side stm, uint8_t& value) const {
+				std::array<PieceSquare, MAX_PIECES> pieces;
+				uint32_t n = 0;
+
+				if (bd.getPieceCount(Side::UP) + bd.getPieceCount(Side::DOWN) > maxPieces) {
+					return false;
+				}
+
+				for (Side side : { Side::UP, Side::DOWN }) {
+					for (uint32_t i = 0; i < bd.getPieceCount(side); ++i) {
+						uint32_t sq = bd.getPieceSquare(side, i);
+						pieces[n++] = PieceSquare{ bd.get(sq), Board::toSquare90(sq) };
+					}
+				}
+
+				Signature sig;
+				uint64_t index = 0;
+				if (!locate(pieces.data(), n, stm, sig, index)) {
+					return false;
+				}
+
+				auto it = tables.find(sig.code());
+				if (it == tables.end()) {
+					return false;
+				}
+
+				value = it->second->get(index);
+				return value != BROKEN;
+			}
+
+			bool probeScore(const Board& bd, Side stm, uint32_t ply, int32_t& score) const {
+				uint8_t value = DRAW;
+				if (!probe(bd, stm, value)) {
+					return false;
+				}
+
+				const int32_t distance = static_cast<int32_t>(ply + dtmOf(value));
+				score = value == DRAW ? 0 : isWin(value) ? MATE_VALUE - distance : -MATE_VALUE + distance;
+				return true;
+			}
+		};
+
+		/*
+			Builds a table and, first, every table a capture can lead to, those already in the directory are loaded
+			instead. A table is solved by sweeps over all its positions, split over the threads: sweep 0 marks the
+			impossible positions and the ones without a legal move, sweep n finds the wins in n plies (odd n), a move
+			to a loss in n - 1, or the losses in n plies (even n), every move going to a win in less than n. Values
+			only ever go from draw to decided, and a sweep reads other positions only for the kind of value it doesn't
+			write, so the threads need no locks. The sweeps end when one changes nothing and no subtable has a longer
+			mate left, what is undecided then is a draw.
+		*/
+		class Generator {
+		private:
+			std::string dir;
+			uint32_t threadNum;
+			std::unordered_map<uint32_t, std::vector<uint8_t>> solved;
+			std::unordered_map<uint32_t, uint32_t> maxDtm;
+
+			// Value of a position from its side to move, in the table being solved or in a solved one.
+			uint8_t valueOf(const PieceSquare* pieces, uint32_t n, Side stm, uint32_t code, const std::atomic<uint8_t>* values) const {
+				Signature sig;
+				uint64_t index = 0;
+
+				if (!locate(pieces, n, stm, sig, index)) {
+					return BROKEN;
+				}
+
+				return sig.code() == code ? values[index].load(std::memory_order_relaxed) : solved.at(sig.code())[index];
+			}
+
+			// One sweep over [begin, end), returns how many positions it decided.
+			uint64_t sweep(const Signature& sig, std::atomic<uint8_t>* values, uint64_t begin, uint64_t end, uint32_t n) const {
+				const uint32_t code = sig.code();
+				const uint32_t pieceNum = sig.pieceNum();
+				std::array<PieceSquare, MAX_PIECES> pieces, child;
+				std::array<Piece, SQUARE_NUM> squares;
+				Board bd;
+				Side stm{};
+				uint64_t changed = 0;
+
+				for (uint64_t index = begin; index < end; ++index) {
+					if (values[index].load(std::memory_order_relaxed) != DRAW) {
+						continue;
+					}
+
+					if (!decode(sig, index, pieces, stm)) {
+						values[index].store(BROKEN, std::memory_order_relaxed);
+						continue;
+					}
+
+					squares.fill(Piece::EE);
+					for (uint32_t i = 0; i < pieceNum; ++i) {
+						squares[pieces[i].sq] = pieces[i].piece;
+					}
+					bd.setPieces(squares, stm);
+
+					Moves moves;
+					if (stm == Side::UP) {
+						genLegalMoves<Side::UP>(bd, moves);
+					}
+					else {
+						genLegalMoves<Side::DOWN>(bd, moves);
+					}
+
+					if (n == 0) {
+						if (inCheck(bd, p_util::getReverseSide(stm))) {
+							values[index].store(BROKEN, std::memory_order_relaxed);
+						}
+						else if (moves.empty()) {
+							values[index].store(1, std::memory_order_relaxed);
+							++changed;
+						}
+						continue;
+					}
+
+					const bool findWin = n % 2 == 1;
+					bool decided = !findWin;
+
+					for (const auto& m : moves) {
+						const uint32_t from = Board::toSquare90(m.from()), to = Board::toSquare90(m.to());
+						uint32_t childNum = 0;
+
+						for (uint32_t i = 0; i < pieceNum; ++i) {
+							if (pieces[i].sq == to) {
+								continue;
+							}
+							child[childNum++] = PieceSquare{ pieces[i].piece, pieces[i].sq == from ? to : pieces[i].sq };
+						}
+
+						uint8_t value = valueOf(child.data(), childNum, p_util::getReverseSide(stm), code, values);
+						if (findWin && isLoss(value) && dtmOf(value) < n) {
+							decided = true;
+							break;
+						}
+						if (!findWin && !(isWin(value) && dtmOf(value) < n)) {
+							decided = false;
+							break;
+						}
+					}
+
+					if (decided) {
+						values[index].store(static_cast<uint8_t>(n + 1), std::memory_order_relaxed);
+						++changed;
+					}
+				}
+
+				return changed;
+			}
+
+			std::vector<uint8_t> solve(const Signature& sig, uint32_t subDtm) const {
+				const uint64_t size = sig.size();
+				std::unique_ptr<std::atomic<uint8_t>[]> values{ new std::atomic<uint8_t>[size] };
+				for (uint64_t i = 0; i < size; ++i) {
+					values[i].store(DRAW, std::memory_order_relaxed);
+				}
+
+				for (uint32_t n = 0; n <= MAX_DTM; ++n) {
+					std::vector<uint64_t> changed(threadNum);
+					std::vector<std::thread> threads;
+
+					for (uint32_t t = 0; t < threadNum; ++t) {
+						threads.emplace_back([&, t]() {
+							changed[t] = sweep(sig, values.get(), size * t / threadNum, size * (t + 1) / threadNum, n);
+						});
+					}
+					for (auto& th : threads) {
+						th.join();
+					}
+
+					if (n > subDtm && std::accumulate(changed.begin(), changed.end(), uint64_t{ 0 }) == 0) {
+						break;
+					}
+				}
+
+				std::vector<uint8_t> result(size);
+				for (uint64_t i = 0; i < size; ++i) {
+					result[i] = values[i].load(std::memory_order_relaxed);
+				}
+				return result;
+			}
+
+			// Reads a table file back whole, a subtable is looked up at random during the sweeps.
+			static bool loadAll(const std::string& fileName, const Signature& sig, std::vector<uint8_t>& values) {
+				Table table;
+				if (!table.open(fileName, sig.size())) {
+					return false;
+				}
+
+				values.resize(sig.size());
+				for (uint64_t i = 0; i < values.size(); ++i) {
+					values[i] = table.get(i);
+				}
+				return true;
+			}
+		public:
+			Generator(const std::string& _dir, uint32_t _threadNum) : dir(_dir), threadNum(std::max(1u, _threadNum)), solved{}, maxDtm{} {}
+
+			bool generate(const Signature& signature) {
+				const Signature sig = signature.canonical();
+				const uint32_t code = sig.code();
+				if (solved.count(code) != 0) {
+					return true;
+				}
+
+				// Every capture leads to a subtable, its longest mate bounds the sweeps of this one.
+				uint32_t subDtm = 0;
+				for (Side side : { Side::UP, Side::DOWN }) {
+					for (uint32_t i = 0; i < sig.counts[static_cast<uint32_t>(side)]; ++i) {
+						Signature sub;
+						for (Side s : { Side::UP, Side::DOWN }) {
+							for (uint32_t j = 0; j < sig.counts[static_cast<uint32_t>(s)]; ++j) {
+								if (s != side || j != i) {
+									sub.add(s, sig.types[static_cast<uint32_t>(s)][j]);
+								}
+							}
+						}
+
+						if (!generate(sub)) {
+							return false;
+						}
+						subDtm = std::max(subDtm, maxDtm[sub.canonical().code()]);
+					}
+				}
+
+				const std::string fileName = fileNameOf(dir, sig);
+				auto start = std::chrono::steady_clock::now();
+				std::vector<uint8_t> values;
+				bool loaded = loadAll(fileName, sig, values);
+
+				if (!loaded) {
+					values = solve(sig, subDtm);
+					if (!Table::write(fileName, values)) {
+						std::cout << "tbgen: can't write " << fileName << "\n";
+						return false;
+					}
+				}
+
+				uint64_t wins = 0, losses = 0, draws = 0;
+				uint32_t longest = 0;
+				for (uint8_t v : values) {
+					wins += isWin(v);
+					losses += isLoss(v);
+					draws += v == DRAW;
+					if (v != DRAW && v != BROKEN) {
+						longest = std::max(longest, dtmOf(v));
+					}
+				}
+
+				std::cout << "tbgen: " << sig.name() << (loaded ? " loaded" : " solved") << ", " << values.size() << " entries, "
+					<< wins << " wins " << losses << " losses " << draws << " draws, longest mate " << longest << " plies, "
+					<< std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << "s\n";
+
+				maxDtm[code] = longest;
+				solved[code] = std::move(values);
+				return true;
+			}
+		};
+	};
+
+	/*
+		Returns true if the entry is deep enough to decide this node, either by an exact score or by a bound outside [alpha, beta].
+		Otherwise the window is narrowed by the stored bound.
+	*/
+	inline bool probeCutoff(const TTEntry* entry, uint32_t searchDepth, int32_t& alpha, int32_t& beta, int32_t& score) {
+		if (entry == nullptr || entry->depth < searchDepth) {
+			return false;
+		}
+
+		if (entry->bound == Bound::EXACT) {
+			score = entry->score;
+			return true;
+		}
+
+		if (entry->bound == Bound::LOWER) {
+			alpha = std::max(alpha, entry->score);
+		}
+		else if (entry->bound == Bound::UPPER) {
+			beta = std::min(beta, entry->score);
+		}
+
+		if (alpha >= beta) {
+			score = entry->score;
+			return true;
+		}
+
+		return false;
+	}
+
+	inline Bound boundOf(int32_t score, int32_t alpha, int32_t beta) noexcept {
+		if (score <= alpha) {
+			return Bound::UPPER;
+		}
+		else if (score >= beta) {
+			return Bound::LOWER;
+		}
+
+		return Bound::EXACT;
+	}
+
+	// The hash move is searched first, the rest keep generation order.
+	inline void orderHashMove(Moves& moves, const TTEntry* entry) {
+		if (entry == nullptr) {
+			return;
+		}
+
+		auto it = std::find(moves.begin(), moves.end(), entry->bestMove);
+		if (it != moves.end()) {
+			std::rotate(moves.begin(), it, it + 1);
+		}
+	}
+
+	constexpr uint32_t MAX_PLY = 64;
+
+	/*
+		Define GCHESS_STATS to count search statistics. Without it STATS_ENABLED is false and every update sits behind a
+		constant test the compiler drops, so the normal build searches exactly as before. Each thread counts into its
+		own SearchContext, searchBestMove sums them when the search ends.
+	*/
+#ifdef GCHESS_STATS
+	constexpr bool STATS_ENABLED = true;
+#else
+	constexpr bool STATS_ENABLED = false;
+#endif
+
+	// A completed iteration of the main thread. nodes are those of all threads and time is since the search started.
+	struct IterationStats {
+		uint32_t depth;
+		int32_t score;
+		uint64_t nodes;
+		std::chrono::milliseconds time;
+	};
+
+	// qnodes are the quiescence nodes among the nodes of the result. Beta cutoffs are those of the pvSearch move loop.
+	struct SearchStats {
+		uint64_t qnodes;
+		uint64_t betaCutoffs;
+		uint64_t firstMoveCutoffs;
+		uint64_t ttProbes;
+		uint64_t ttHits;
+		uint32_t threads;
+		std::chrono::milliseconds time;
+		std::vector<IterationStats> iterations;
+
+		SearchStats() : qnodes(0), betaCutoffs(0), firstMoveCutoffs(0), ttProbes(0), ttHits(0), threads(1), time(0), iterations{} {}
+
+		// Sums the counters of another thread of the same search.
+		void add(const SearchStats& other) {
+			qnodes += other.qnodes;
+			betaCutoffs += other.betaCutoffs;
+			firstMoveCutoffs += other.firstMoveCutoffs;
+			ttProbes += other.ttProbes;
+			ttHits += other.ttHits;
+		}
+	};
+
+	struct SearchResult;
+
+	/*
+		Budget of one move. A zero moveTime or maxNodes means unlimited, the search stops at whichever limit is hit first.
+		stopSignal lets another thread end the search early, and onIteration is called by the main search thread after
+		every completed iteration, both are optional.
+	*/
+	struct SearchLimits {
+		uint32_t maxDepth;
+		std::chrono::milliseconds moveTime;
+		uint64_t maxNodes;
+		const std::atomic<bool>* stopSignal;
+		std::function<void(const SearchResult&)> onIteration;
+
+		SearchLimits() : maxDepth(MAX_PLY - 1), moveTime(0), maxNodes(0), stopSignal(nullptr), onIteration{} {}
+	};
+
+	/*
+		Switches and parameters of the selective search, so each technique can be measured on its own.
+		Null-move pruning: give the opponent a free move and search with depth reduced by nullMoveReduction, if we are
+		still above beta the node is cut. Late move reductions: quiet moves from lmrMinMoveIndex on are searched
+		reduced first. Futility pruning: near the leaves, quiet moves that don't give check are skipped when the static
+		score plus futilityMargin per ply of depth left can't reach alpha.
+	*/
+	struct SearchConfig {
+		bool nullMove;
+		uint32_t nullMoveMinDepth;
+		uint32_t nullMoveReduction;
+
+		bool lateMoveReduction;
+		uint32_t lmrMinDepth;
+		uint32_t lmrMinMoveIndex;
+
+		bool futility;
+		uint32_t futilityMaxDepth;
+		int32_t futilityMargin;
+
+		// Probed below the root once few enough pieces are left, null for none.
+		const tablebase::Tablebases* tablebases;
+
+		// Called by searchBestMove with the position, the side to move and the result of every search, optional.
+		std::function<void(const Board&, Side, const SearchResult&)> onSearch;
+
+		SearchConfig() :
+			nullMove(true), nullMoveMinDepth(3), nullMoveReduction(2),
+			lateMoveReduction(true), lmrMinDepth(3), lmrMinMoveIndex(3),
+			futility(true), futilityMaxDepth(2), futilityMargin(60),
+			tablebases(nullptr), onSearch{}
+		{}
+	};
+
+	// score is a board score like calcBoardScore, positive is good for DOWN.
+	struct SearchResult {
+		Move bestMove;
+		int32_t score;
+		uint32_t depth;
+		uint64_t nodes;
+		std::vector<Move> pv;
+		// Only counted with GCHESS_STATS.
+		SearchStats stats;
+
+		SearchResult() : bestMove{}, score(0), depth(0), nodes(0), pv{}, stats{} {}
+	};
+
+	/*
+		Everything the threads of one search share besides the transposition table.
+	*/
+	struct SharedSearchState {
+		std::atomic<bool> stopFlag;
+		std::atomic<uint64_t> nodes;
+		std::chrono::steady_clock::time_point startTime;
+
+		SharedSearchState() : stopFlag(false), nodes(0), startTime(std::chrono::steady_clock::now()) {}
+	};
+
+	/*
+		Per-thread state of one search: limits, node counter, the triangular PV table and the move ordering tables.
+		prevPv holds the PV of the last completed iteration, it is searched first while the search is still on it.
+	*/
+	struct SearchContext {
+		constexpr static uint64_t CHECK_LIMITS_MASK = 1023;
+
+		constexpr static int32_t HISTORY_MAX = 1 << 24;
+
+		TransTable& tt;
+		const SearchLimits& limits;
+		const SearchConfig& config;
+		SharedSearchState& shared;
+		uint64_t nodes;
+		bool followPv;
+		// Set by pvSearch for its caller: the score came from a repetition, so it only holds on this path.
+		bool pathDependent;
+		std::vector<Move> prevPv;
+		std::array<std::array<Move, MAX_PLY>, MAX_PLY> pv;
+		std::array<uint32_t, MAX_PLY> pvLength;
+
+		std::array<std::array<Move, 2>, MAX_PLY> killers;
+		std::array<std::array<int32_t, Board::SQUARE_NUM>, 14> history;
+
+		SearchStats stats;
+
+		SearchContext(TransTable& _tt, const SearchLimits& _limits, const SearchConfig& _config, SharedSearchState& _shared) :
+			tt(_tt), limits(_limits), config(_config), shared(_shared),
+			nodes(0), followPv(false), pathDependent(false), prevPv{}, pv{}, pvLength{}, killers{}, history{}, stats{}
+		{}
+
+		std::chrono::milliseconds elapsed() const {
+			return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - shared.startTime);
+		}
+
+		bool stopped() const noexcept {
+			return shared.stopFlag.load(std::memory_order_relaxed);
+		}
+
+		void stop() noexcept {
+			shared.stopFlag.store(true, std::memory_order_relaxed);
+		}
+
+		// Called once per node, the shared counter and the clock are only touched every CHECK_LIMITS_MASK + 1 nodes.
+		void countNode() {
+			if ((++nodes & CHECK_LIMITS_MASK) == 0) {
+				uint64_t totalNodes = shared.nodes.fetch_add(CHECK_LIMITS_MASK + 1, std::memory_order_relaxed) + CHECK_LIMITS_MASK + 1;
+
+				if (limits.maxNodes != 0 && totalNodes >= limits.maxNodes) {
+					stop();
+				}
+				else if (limits.stopSignal != nullptr && limits.stopSignal->load(std::memory_order_relaxed)) {
+					stop();
+				}
+				else if (limits.moveTime.count() != 0 && elapsed() >= limits.moveTime) {
+					stop();
+				}
+			}
+		}
+
+		// The move of the previous iteration's PV at this ply, while the search is still on that PV.
+		Move pvMoveAt(uint32_t ply) const noexcept {
+			return followPv && ply < prevPv.size() ? prevPv[ply] : Move{};
+		}
+
+		// MVV-LVA: the most valuable victim first, among equal victims the least valuable attacker.
+		static int32_t captureScore(const Board& bd, const Move& m) {
+			return (std::abs(getPieceValue(bd.get(m.to()))) << 8) - std::min(std::abs(getPieceValue(bd.get(m.from()))), 255);
+		}
+
+		// Quiet moves are ordered by the history score of (piece, destination).
+		int32_t quietScore(const Board& bd, const Move& m) const {
+			return history[p_util::pieceToInt32(bd.get(m.from()))][m.to()];
+		}
+
+		// Called on a beta cutoff. Captures are already ordered well by MVV-LVA, only quiet moves are remembered.
+		void updateQuietCutoff(const Board& bd, const Move& m, uint32_t ply, uint32_t searchDepth) {
+			if (bd.get(m.to()) != Piece::EE) {
+				return;
+			}
+
+			if (killers[ply][0] != m) {
+				killers[ply][1] = killers[ply][0];
+				killers[ply][0] = m;
+			}
+
+			int32_t& h = history[p_util::pieceToInt32(bd.get(m.from()))][m.to()];
+			h += static_cast<int32_t>(searchDepth * searchDepth);
+
+			if (h >= HISTORY_MAX) {
+				for (auto& row : history) {
+					for (auto& value : row) {
+						value /= 2;
+					}
+				}
+			}
+		}
+
+		void updatePv(uint32_t ply, const Move& m) {
+			pv[ply][0] = m;
+			std::copy(pv[ply + 1].begin(), pv[ply + 1].begin() + pvLength[ply + 1], pv[ply].begin() + 1);
+			pvLength[ply] = pvLength[ply + 1] + 1;
+		}
+	};
+
+	/*
+		Hands out the moves of a node in stages: the PV and hash moves, captures by MVV-LVA, the two killers of the ply,
+		then the remaining quiet moves by history. A stage is only generated once the previous one is used up, and its
+		moves are picked best first by selection, so a node that cuts off early never generates or sorts the rest.
+		Moves are pseudo-legal, the search still tests the own general after making one.
+	*/
+	template<Side side>
+	class MovePicker {
+	private:
+		enum class Stage {
+			FIRST_MOVES, GEN_CAPTURES, CAPTURES, KILLERS, GEN_QUIETS, QUIETS, DONE
+		};
+
+		const Board& bd;
+		const SearchContext& ctx;
+		uint32_t ply;
+		bool capturesOnly;
+		Stage stage;
+
+		std::array<Move, 2> firstMoves;
+		uint32_t firstMoveNum;
+		uint32_t firstIndex;
+
+		std::array<Move, 2> killerMoves;
+		uint32_t killerMoveNum;
+		uint32_t killerIndex;
+
+		Moves moves;
+		std::array<int32_t, MoveList::MAX_MOVES> scores;
+		size_t moveIndex;
+	private:
+		bool isFirstMove(const Move& m) const noexcept {
+			return (firstMoveNum > 0 && firstMoves[0] == m) || (firstMoveNum > 1 && firstMoves[1] == m);
+		}
+
+		bool isKillerMove(const Move& m) const noexcept {
+			return (killerMoveNum > 0 && killerMoves[0] == m) || (killerMoveNum > 1 && killerMoves[1] == m);
+		}
+
+		void addFirstMove(const Move& m) {
+			if (m != Move{} && !isFirstMove(m) && isPseudoLegal<side>(bd, m)) {
+				firstMoves[firstMoveNum++] = m;
+			}
+		}
+
+		template<GenType G>
+		void generate() {
+			moves.clear();
+			genMoves<side, G>(bd, moves);
+
+			for (size_t i = 0; i < moves.size(); ++i) {
+				scores[i] = G == GenType::CAPTURES ? SearchContext::captureScore(bd, moves[i]) : ctx.quietScore(bd, moves[i]);
+			}
+
+			moveIndex = 0;
+		}
+
+		// One selection sort step, the best remaining move of the stage is swapped to moveIndex and handed out.
+		bool pickBest(Move& m) {
+			while (moveIndex < moves.size()) {
+				size_t best = moveIndex;
+				for (size_t i = moveIndex + 1; i < moves.size(); ++i) {
+					if (scores[i] > scores[best]) {
+						best = i;
+					}
+				}
+
+				std::swap(moves[moveIndex], moves[best]);
+				std::swap(scores[moveIndex], scores[best]);
+				m = moves[moveIndex++];
+
+				if (!isFirstMove(m) && !isKillerMove(m)) {
+					return true;
+				}
+			}
+
+			return false;
+		}
+	public:
+		/*
+			capturesOnly skips the first moves, the killers and the quiet moves, it is what the quiescence search
+			wants when it isn't in check.
+		*/
+		MovePicker(const Board& _bd, const SearchContext& _ctx, uint32_t _ply, const Move& pvMove, const Move& hashMove, bool _capturesOnly) :
+			bd(_bd), ctx(_ctx), ply(_ply), capturesOnly(_capturesOnly), stage(Stage::FIRST_MOVES),
+			firstMoves{}, firstMoveNum(0), firstIndex(0),
+			killerMoves{}, killerMoveNum(0), killerIndex(0),
+			moves{}, scores{}, moveIndex(0)
+		{
+			if (!capturesOnly) {
+				addFirstMove(pvMove);
+				addFirstMove(hashMove);
+			}
+		}
+
+		bool next(Move& m) {
+			while (true) {
+				switch (stage) {
+				case Stage::FIRST_MOVES:
+					if (firstIndex < firstMoveNum) {
+						m = firstMoves[firstIndex++];
+						return true;
+					}
+
+					stage = Stage::GEN_CAPTURES;
+					break;
+				case Stage::GEN_CAPTURES:
+					generate<GenType::CAPTURES>();
+					stage = Stage::CAPTURES;
+					break;
+				case Stage::CAPTURES:
+					if (pickBest(m)) {
+						return true;
+					}
+
+					stage = capturesOnly ? Stage::DONE : Stage::KILLERS;
+					break;
+				case Stage::KILLERS:
+					while (killerIndex < 2) {
+						const Move& killer = ctx.killers[ply][killerIndex++];
+
+						if (killer != Move{} && !isFirstMove(killer) && bd.get(killer.to()) == Piece::EE && isPseudoLegal<side>(bd, killer)) {
+							killerMoves[killerMoveNum++] = killer;
+							m = killer;
+							return true;
+						}
+					}
+
+					stage = Stage::GEN_QUIETS;
+					break;
+				case Stage::GEN_QUIETS:
+					generate<GenType::QUIETS>();
+					stage = Stage::QUIETS;
+					break;
+				case Stage::QUIETS:
+					if (pickBest(m)) {
+						return true;
+					}
+
+					stage = Stage::DONE;
+					break;
+				case Stage::DONE:
+					return false;
+				}
+			}
+		}
+	};
+
+	/*
+		A capture that can't move the score by more than this on top of the captured piece is pruned in the quiescence
+		search. Piece-square swings in posValueMap stay below it.
+	*/
+	constexpr int32_t QS_DELTA_MARGIN = 60;
+
+	// The board score is from DOWN's view, the negamax search wants it from the side to move. A board with a
+	// network set is evaluated by the network instead.
+	template<Side side>
+	inline int32_t evaluateFor(const Board& bd) {
+		if (bd.getNetwork() != nullptr) {
+			return bd.getNetwork()->evaluate(bd.getAccumulator(), side);
+		}
+
+		return side == Side::DOWN ? calcBoardScore(bd) : -calcBoardScore(bd);
+	}
+
+	/*
+		Quiescence search, only captures are searched until the position is quiet. The side to move may always
+		stand pat on the static score instead of capturing, captures that can't reach the window are delta-pruned.
+		A side in check can't stand pat, it searches all its evasions instead.
+	*/
+	template<Side side>
+	int32_t quiesce(Board& bd, SearchContext& ctx, uint32_t ply, int32_t alpha, int32_t beta) {
+		ctx.countNode();
+		if (STATS_ENABLED) {
+			++ctx.stats.qnodes;
+		}
+
+		const bool checked = inCheck<side>(bd);
+		int32_t standPat = evaluateFor<side>(bd);
+		if (ply >= MAX_PLY - 1 || (!checked && standPat >= beta)) {
+			return standPat;
+		}
+
+		if (!checked) {
+			alpha = std::max(alpha, standPat);
+		}
+
+		MovePicker<side> picker{ bd, ctx, ply, Move{}, Move{}, !checked };
+		int32_t bestValue = checked ? -MATE_VALUE + static_cast<int32_t>(ply) : standPat;
+		Move m;
+
+		while (picker.next(m)) {
+			if (ctx.stopped()) {
+				return bestValue;
+			}
+
+			if (!checked && standPat + std::abs(getPieceValue(bd.get(m.to()))) + QS_DELTA_MARGIN <= alpha) {
+				continue;
+			}
+
+			bd.move(m);
+			if (inCheck<side>(bd)) {
+				bd.undo();
+				continue;
+			}
+
+			int32_t value = -quiesce<p_util::getReverseSide(side)>(bd, ctx, ply + 1, -beta, -alpha);
+			bd.undo();
+
+			bestValue = std::max(bestValue, value);
+			alpha = std::max(alpha, bestValue);
+			if (alpha >= beta) {
+				break;
+			}
+		}
+
+		return bestValue;
+	}
+
+	/*
+		Principal variation search in negamax form, scores are from the side to move. The first move gets the full
+		window, the rest are only scouted with a null window around alpha to prove they are no better, and are
+		searched again with the full window when the scout says they are.
+
+		Moves are generated pseudo-legal and a move leaving the own general attacked is skipped after it is made.
+		A side without a legal move has lost, be it checkmate or stalemate. Moves that give check are extended by a ply.
+		A position repeated below the root is scored by checkRepetition right away instead of searching the cycle again.
+		That score depends on the moves that led to the position, not only on the position, so a node whose result
+		rests on one isn't stored in the shared table, where another path or thread would take it for its own.
+	*/
+	template<Side side>
+	int32_t pvSearch(Board& bd, SearchContext& ctx, uint32_t searchDepth, uint32_t ply, int32_t alpha, int32_t beta, bool allowNull = true) {
+		constexpr Side enemy = p_util::getReverseSide(side);
+		ctx.pvLength[ply] = 0;
+
+		if (ply > 0) {
+			const Repetition repetition = checkRepetition<side>(bd);
+			if (repetition != Repetition::NONE) {
+				ctx.pathDependent = true;
+				return repetition == Repetition::DRAW ? 0 : repetition == Repetition::WIN ? BAN_VALUE : -BAN_VALUE;
+			}
+		}
+		ctx.pathDependent = false;
+
+		if (searchDepth == 0 || ply >= MAX_PLY - 1) {
+			return quiesce<side>(bd, ctx, ply, alpha, beta);
+		}
+
+		ctx.countNode();
+
+		int32_t tbScore{};
+		const tablebase::Tablebases* tablebases = ctx.config.tablebases;
+		if (ply > 0 && tablebases != nullptr && bd.getPieceCount(Side::UP) + bd.getPieceCount(Side::DOWN) <= tablebases->getMaxPieces()
+			&& tablebases->probeScore(bd, side, ply, tbScore)) {
+			return tbScore;
+		}
+
+		const uint64_t key = bd.getKey();
+		TTEntry ttEntry;
+		const TTEntry* entry = ctx.tt.probe(key, ttEntry) ? &ttEntry : nullptr;
+		int32_t ttScore{};
+		if (STATS_ENABLED) {
+			++ctx.stats.ttProbes;
+			ctx.stats.ttHits += entry != nullptr;
+		}
+		if (entry != nullptr) {
+			ttEntry.score = scoreFromTT(ttEntry.score, ply);
+		}
+
+		if (probeCutoff(entry, searchDepth, alpha, beta, ttScore)) {
+			return ttScore;
+		}
+
+		const int32_t originAlpha = alpha;
+		// The root window can be [MIN_VALUE, MAX_VALUE], whose width doesn't fit an int32_t.
+		const bool isPvNode = static_cast<int64_t>(beta) - alpha > 1;
+		const bool checked = inCheck<side>(bd);
+		const int32_t staticValue = evaluateFor<side>(bd);
+		const SearchConfig& config = ctx.config;
+
+		if (config.nullMove && allowNull && !isPvNode && !checked && searchDepth >= config.nullMoveMinDepth
+			&& staticValue >= beta && hasMajorPiece<side>(bd)) {
+			uint32_t reducedDepth = searchDepth > config.nullMoveReduction + 1 ? searchDepth - config.nullMoveReduction - 1 : 0;
+			ctx.followPv = false;
+
+			bd.moveNull();
+			int32_t value = -pvSearch<enemy>(bd, ctx, reducedDepth, ply + 1, -beta, -beta + 1, false);
+			bd.undoNull();
+
+			if (ctx.stopped()) {
+				return value;
+			}
+
+			if (value >= beta) {
+				return beta;
+			}
+		}
+
+		const bool futile = config.futility && !isPvNode && !checked && searchDepth <= config.futilityMaxDepth
+			&& staticValue + config.futilityMargin * static_cast<int32_t>(searchDepth) <= alpha;
+
+		const Move pvMove = ctx.pvMoveAt(ply);
+		MovePicker<side> picker{ bd, ctx, ply, pvMove, entry != nullptr ? entry->bestMove : Move{}, false };
+
+		int32_t bestValue = MIN_VALUE;
+		Move bestMove{};
+		uint32_t legalMoves = 0;
+		bool pruned = false;
+		// A cutoff only rests on the move that cut, any other result on all the moves searched.
+		bool pathDependent = false;
+		Move m;
+
+		for (uint32_t i = 0; picker.next(m); ++i) {
+			if (ctx.stopped()) {
+				return bestValue;
+			}
+
+			const bool isQuiet = bd.get(m.to()) == Piece::EE;
+			ctx.followPv = i == 0 && m == pvMove && pvMove != Move{};
+
+			bd.move(m);
+			if (inCheck<side>(bd)) {
+				bd.undo();
+				continue;
+			}
+
+			// Checks are exempt from futility pruning like from reductions, the check extension would search them.
+			const bool givesCheck = inCheck<enemy>(bd);
+			if (futile && isQuiet && !givesCheck && legalMoves > 0) {
+				bd.undo();
+				bestValue = std::max(bestValue, staticValue + config.futilityMargin * static_cast<int32_t>(searchDepth));
+				pruned = true;
+				continue;
+			}
+
+			++legalMoves;
+			const uint32_t newDepth = givesCheck ? searchDepth : searchDepth - 1;
+
+			int32_t value{};
+			if (legalMoves == 1) {
+				value = -pvSearch<enemy>(bd, ctx, newDepth, ply + 1, -beta, -alpha);
+			}
+			else {
+				// Never below depth 2 whatever lmrMinDepth says, so newDepth is at least 1 and the reduction can't wrap it.
+				bool reduced = config.lateMoveReduction && isQuiet && !checked && !givesCheck && searchDepth >= std::max(config.lmrMinDepth, 2u)
+					&& legalMoves > config.lmrMinMoveIndex && m != ctx.killers[ply][0] && m != ctx.killers[ply][1];
+
+				if (reduced) {
+					uint32_t reduction = std::min(searchDepth >= 6 && legalMoves > 2 * config.lmrMinMoveIndex ? 2u : 1u, newDepth);
+					value = -pvSearch<enemy>(bd, ctx, newDepth - reduction, ply + 1, -alpha - 1, -alpha);
+				}
+
+				if (!reduced || value > alpha) {
+					value = -pvSearch<enemy>(bd, ctx, newDepth, ply + 1, -alpha - 1, -alpha);
+				}
+
+				if (value > alpha && value < beta) {
+					value = -pvSearch<enemy>(bd, ctx, newDepth, ply + 1, -beta, -alpha);
+				}
+			}
+			bd.undo();
+			pathDependent |= ctx.pathDependent;
+
+			if (value > bestValue) {
+				bestValue = value;
+				bestMove = m;
+				ctx.updatePv(ply, m);
+			}
+
+			alpha = std::max(alpha, bestValue);
+			if (alpha >= beta) {
+				if (STATS_ENABLED) {
+					++ctx.stats.betaCutoffs;
+					ctx.stats.firstMoveCutoffs += legalMoves == 1;
+				}
+				pathDependent = ctx.pathDependent;
+				ctx.updateQuietCutoff(bd, m, ply, searchDepth);
+				break;
+			}
+		}
+
+		if (legalMoves == 0 && !pruned) {
+			ctx.pathDependent = false;
+			return -MATE_VALUE + static_cast<int32_t>(ply);
+		}
+
+		if (!ctx.stopped() && !pathDependent) {
+			ctx.tt.store(key, searchDepth, boundOf(bestValue, originAlpha, beta), scoreToTT(bestValue, ply), bestMove);
+		}
+
+		ctx.pathDependent = pathDependent;
+		return bestValue;
+	}
+
+	// TT cutoffs cut the PV short, the rest of the line is recovered by following the hash moves.
+	void extendPvFromTT(Board& bd, const TransTable& tt, Side side, std::vector<Move>& pv, uint32_t depth) {
+		for (const auto& m : pv) {
+			bd.move(m);
+			side = p_util::getReverseSide(side);
+		}
+
+		uint32_t played = static_cast<uint32_t>(pv.size());
+
+		while (pv.size() < depth) {
+			TTEntry entry;
+			if (!tt.probe(bd.getKey(), entry)) {
+				break;
+			}
+
+			const Move& m = entry.bestMove;
+			if (p_util::getSide(bd.get(m.from())) != side || !isValidMove(bd, m)) {
+				break;
+			}
+
+			pv.push_back(m);
+			bd.move(m);
+			side = p_util::getReverseSide(side);
+			++played;
+		}
+
+		while (played-- > 0) {
+			bd.undo();
+		}
+	}
+
+	/*
+		Searches the root moves inside [alpha, beta] the same way as pvSearch and returns the best value from S's
+		view. bestMove and the root PV are only meaningful when the result is inside the window.
+	*/
+	template<Side S>
+	int32_t searchRoot(Board& bd, SearchContext& ctx, const Moves& moves, uint32_t depth, int32_t alpha, int32_t beta, Move& bestMove) {
+		constexpr Side enemy = p_util::getReverseSide(S);
+		int32_t bestValue = MIN_VALUE;
+		ctx.pvLength[0] = 0;
+
+		for (size_t i = 0; i < moves.size() && !ctx.stopped(); ++i) {
+			const auto& m = moves[i];
+			ctx.followPv = i == 0;
+
+			bd.move(m);
+			int32_t value{};
+			if (i == 0) {
+				value = -pvSearch<enemy>(bd, ctx, depth - 1, 1, -beta, -alpha);
+			}
+			else {
+				value = -pvSearch<enemy>(bd, ctx, depth - 1, 1, -alpha - 1, -alpha);
+				if (value > alpha && value < beta && !ctx.stopped()) {
+					value = -pvSearch<enemy>(bd, ctx, depth - 1, 1, -beta, -alpha);
+				}
+			}
+			bd.undo();
+
+			if (!ctx.stopped() && value > bestValue) {
+				bestValue = value;
+				bestMove = m;
+				ctx.updatePv(0, m);
+			}
+
+			alpha = std::max(alpha, bestValue);
+			if (alpha >= beta) {
+				break;
+			}
+		}
+
+		return bestValue;
+	}
+
+	/*
+		From ASPIRATION_MIN_DEPTH on, an iteration first searches a narrow window around the score of the previous
+		one. A result outside the window is only a bound, that side of the window is widened and the root searched again.
+	*/
+	constexpr uint32_t ASPIRATION_MIN_DEPTH = 4;
+	constexpr int32_t ASPIRATION_WINDOW = 25;
+
+	/*
+		Iterative deepening loop of one search thread. Depth startDepth, startDepth + 1, ... is searched until a limit
+		is hit, a stopped iteration is thrown away so the result always comes from the last completed one.
+		Each iteration searches the previous PV first.
+	*/
+	template<Side S>
+	SearchResult iterativeDeepening(Board& bd, SearchContext& ctx, uint32_t startDepth, bool isMainThread) {
+		SearchResult result;
+		TTEntry rootEntry;
+
+		Moves moves;
+		genLegalMoves<S>(bd, moves);
+		orderHashMove(moves, ctx.tt.probe(bd.getKey(), rootEntry) ? &rootEntry : nullptr);
+
+		if (moves.empty()) {
+			return result;
+		}
+
+		result.bestMove = moves.front();
+		int32_t prevValue = 0;
+
+		for (uint32_t depth = startDepth; depth <= ctx.limits.maxDepth && depth < MAX_PLY; ++depth) {
+			int32_t delta = ASPIRATION_WINDOW;
+			bool aspiration = depth >= ASPIRATION_MIN_DEPTH && std::abs(prevValue) < MAX_VALUE / 2;
+			int32_t alpha = aspiration ? prevValue - delta : MIN_VALUE;
+			int32_t beta = aspiration ? prevValue + delta : MAX_VALUE;
+			int32_t bestValue = MIN_VALUE;
+			Move bestMove = moves.front();
+
+			while (true) {
+				bestValue = searchRoot<S>(bd, ctx, moves, depth, alpha, beta, bestMove);
+
+				if (ctx.stopped()) {
+					break;
+				}
+
+				delta *= 2;
+				if (bestValue <= alpha && alpha != MIN_VALUE) {
+					alpha = bestValue - delta > -MAX_VALUE / 2 ? bestValue - delta : MIN_VALUE;
+				}
+				else if (bestValue >= beta && beta != MAX_VALUE) {
+					beta = bestValue + delta < MAX_VALUE / 2 ? bestValue + delta : MAX_VALUE;
+				}
+				else {
+					break;
+				}
+			}
+
+			if (ctx.stopped()) {
+				break;
+			}
+
+			prevValue = bestValue;
+			result.bestMove = bestMove;
+			result.score = S == Side::DOWN ? bestValue : -bestValue;
+			result.depth = depth;
+			result.pv.assign(ctx.pv[0].begin(), ctx.pv[0].begin() + ctx.pvLength[0]);
+
+			ctx.tt.store(bd.getKey(), depth, Bound::EXACT, bestValue, bestMove);
+			extendPvFromTT(bd, ctx.tt, S, result.pv, depth);
+			ctx.prevPv = result.pv;
+
+			auto it = std::find(moves.begin(), moves.end(), bestMove);
+			std::rotate(moves.begin(), it, it + 1);
+
+			if (isMainThread && (STATS_ENABLED || ctx.limits.onIteration)) {
+				// Nodes of all threads so far, the shared counter lags by less than a check interval per thread.
+				result.nodes = ctx.shared.nodes.load(std::memory_order_relaxed) + (ctx.nodes & SearchContext::CHECK_LIMITS_MASK);
+
+				if (STATS_ENABLED) {
+					ctx.stats.iterations.push_back(IterationStats{ depth, result.score, result.nodes, ctx.elapsed() });
+				}
+				if (ctx.limits.onIteration) {
+					ctx.limits.onIteration(result);
+				}
+			}
+
+			// The next iteration costs several times this one, don't start what can't be finished.
+			if (isMainThread && ctx.limits.moveTime.count() != 0 && ctx.elapsed() * 2 >= ctx.limits.moveTime) {
+				break;
+			}
+		}
+
+		result.nodes = ctx.nodes;
+		if (STATS_ENABLED) {
+			result.stats = std::move(ctx.stats);
+		}
+		return result;
+	}
+
+	/*
+		Lazy SMP: every thread runs its own iterative deepening on its own board copy, and they only talk through the
+		shared transposition table. Helpers start at staggered depths so they fill the table ahead of the main thread.
+		The main thread owns time management, when it finishes the helpers are stopped, and the deepest completed
+		iteration of any thread is returned.
+	*/
+	template<Side S>
+	SearchResult searchBestMove(Board& bd, TransTable& tt, const SearchLimits& limits, uint32_t threadNum = 1, const SearchConfig& config = SearchConfig{}) {
+		SharedSearchState shared;
+		tt.newSearch();
+		bd.setPrefetchTable(&tt);
+
+		const uint32_t helperNum = threadNum > 1 ? threadNum - 1 : 0;
+		std::vector<Board> helperBoards(helperNum, bd);
+		std::vector<SearchResult> helperResults(helperNum);
+		std::vector<std::thread> helpers;
+
+		for (uint32_t i = 1; i < threadNum; ++i) {
+			helpers.emplace_back([&tt, &limits, &config, &shared, &helperBoards, &helperResults, i]() {
+				SearchContext ctx{ tt, limits, config, shared };
+				helperResults[i - 1] = iterativeDeepening<S>(helperBoards[i - 1], ctx, 1 + i % 2, false);
+			});
+		}
+
+		SearchContext ctx{ tt, limits, config, shared };
+		SearchResult result = iterativeDeepening<S>(bd, ctx, 1, true);
+		ctx.stop();
+
+		for (auto& helper : helpers) {
+			helper.join();
+		}
+		bd.setPrefetchTable(nullptr);
+
+		SearchStats stats = std::move(result.stats);
+		for (const auto& helperResult : helperResults) {
+			result.nodes += helperResult.nodes;
+			stats.add(helperResult.stats);
+
+			if (helperResult.depth > result.depth) {
+				uint64_t nodes = result.nodes;
+				result = helperResult;
+				result.nodes = nodes;
+			}
+		}
+
+		result.stats = std::move(stats);
+		result.stats.threads = std::max(1u, threadNum);
+		result.stats.time = ctx.elapsed();
+
+		if (config.onSearch) {
+			config.onSearch(bd, S, result);
+		}
+		return result;
+	}
+
+	/*
+		Opening book, a file of entries sorted by position key. It is mapped into memory read-only and binary searched
+		in place, so opening it reads nothing and a probe touches a few pages. Written by "gchess book", little endian:
+			char[4] "GCBK", uint32 version (1), uint64 entry count
+			BookEntry entries[count], sorted by key, then by weight from the highest
+		The entries of a key are the book moves of that position, weighted by the number of games that played them.
+	*/
+	struct BookEntry {
+		uint64_t key;
+		uint16_t move;
+		uint16_t weight;
+		uint32_t reserved;
+	};
+
+	static_assert(sizeof(BookEntry) == 16, "book entries are read from the file as they are");
+
+	class OpeningBook {
+	public:
+		constexpr static uint32_t FILE_VERSION = 1;
+		constexpr static size_t HEADER_SIZE = 16;
+	private:
+		MappedFile file;
+		const BookEntry* entries;
+		size_t entryNum;
+	public:
+		OpeningBook() : file{}, entries(nullptr), entryNum(0) {}
+
+		bool open(const std::string& fileName) {
+			close();
+			uint32_t version = 0;
+			uint64_t count = 0;
+
+			if (!file.open(fileName) || file.size() < HEADER_SIZE) {
+				close();
+				return false;
+			}
+
+			const char* data = file.data();
+			std::memcpy(&version, data + 4, sizeof(version));
+			std::memcpy(&count, data + 8, sizeof(count));
+
+			if (std::memcmp(data, "GCBK", 4) != 0 || version != FILE_VERSION || count != (file.size() - HEADER_SIZE) / sizeof(BookEntry)) {
+				close();
+				return false;
+			}
+
+			entries = reinterpret_cast<const BookEntry*>(data + HEADER_SIZE);
+			entryNum = static_cast<size_t>(count);
+			return true;
+		}
+
+		void close() {
+			file.close();
+			entries = nullptr;
+			entryNum = 0;
+		}
+
+		size_t size() const noexcept {
+			return entryNum;
+		}
+
+		// The book moves of a position, an empty range when it isn't in the book.
+		std::pair<const BookEntry*, const BookEntry*> find(uint64_t key) const noexcept {
+			return std::equal_range(entries, entries + entryNum, BookEntry{ key, 0, 0, 0 },
+				[](const BookEntry& a, const BookEntry& b) { return a.key < b.key; });
+		}
+
+		/*
+			Picks a book move with a probability proportional to its weight, random is any uniformly distributed
+			number. Moves that aren't legal in the position, which only a key collision can give, are skipped.
+		*/
+		template<Side side>
+		Move probe(const Board& bd, uint64_t random) const {
+			auto range = find(bd.getKey());
+			Moves moves;
+			std::array<uint32_t, MoveList::MAX_MOVES> weights;
+			uint64_t total = 0;
+
+			for (const BookEntry* e = range.first; e != range.second && moves.size() < MoveList::MAX_MOVES; ++e) {
+				Move m;
+				m.data = e->move;
+
+				if (e->weight != 0 && p_util::getSide(bd.get(m.from())) == side && isValidMove(bd, m)) {
+					weights[moves.size()] = e->weight;
+					moves.push_back(m);
+					total += e->weight;
+				}
+			}
+
+			if (total == 0) {
+				return Move{};
+			}
+
+			uint64_t pick = random % total;
+			for (size_t i = 0; i < moves.size(); ++i) {
+				if (pick < weights[i]) {
+					return moves[i];
+				}
+				pick -= weights[i];
+			}
+
+			return moves.front();
+		}
+
+		// Sorts the entries as the lookup expects and writes them in the book format.
+		static bool write(const std::string& fileName, std::vector<BookEntry>& bookEntries) {
+			std::sort(bookEntries.begin(), bookEntries.end(), [](const BookEntry& a, const BookEntry& b) {
+				return a.key != b.key ? a.key < b.key : a.weight > b.weight;
+			});
+
+			std::ofstream out{ fileName, std::ios::binary };
+			const uint32_t version = FILE_VERSION;
+			const uint64_t count = bookEntries.size();
+
+			out.write("GCBK", 4);
+			out.write(reinterpret_cast<const char*>(&version), sizeof(version));
+			out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+			out.write(reinterpret_cast<const char*>(bookEntries.data()), static_cast<std::streamsize>(count * sizeof(BookEntry)));
+
+			return static_cast<bool>(out);
+		}
+	};
+
+	// With a book, a position it knows is answered from the book without searching.
+	template<Side S>
+	Move genBestMoveFor(Board& bd, TransTable& tt, const SearchLimits& limits, uint32_t threadNum = 1, const SearchConfig& config = SearchConfig{}, const OpeningBook* book = nullptr) {
+		if (book != nullptr) {
+			static thread_local std::mt19937_64 rng{ std::random_device{}() };
+			Move m = book->probe<S>(bd, rng());
+
+			if (m != Move{}) {
+				return m;
+			}
+		}
+
+		return searchBestMove<S>(bd, tt, limits, threadNum, config).bestMove;
+	}
+};
+
+bool isInputValid(const std::string& input) {
+	std::regex reg{ R"([a-i][0-9][a-i][0-9])" };
+	return std::regex_match(input, reg);
+}
+
+g_chess::Move inputToMove(const std::string& input) {
+	g_chess::Pos from{}, to{};
+	from.row = 9 - static_cast<uint32_t>(input[1] - '0') + g_chess::Board::SINGLE_ROW_PADDING;
+	from.col = static_cast<uint32_t>(input[0] - 'a') + g_chess::Board::SINGLE_COL_PADDING;
+	to.row = 9 - static_cast<uint32_t>(input[3] - '0') + g_chess::Board::SINGLE_ROW_PADDING;
+	to.col = static_cast<uint32_t>(input[2] - 'a') + g_chess::Board::SINGLE_COL_PADDING;
+
+	return g_chess::Move{ from, to };
+}
+
+std::string moveToStr(const g_chess::Move& m) {
+	g_chess::Pos from = m.fromPos();
+	g_chess::Pos to = m.toPos();
+
+	std::string str;
+	str += (from.col - g_chess::Board::SINGLE_COL_PADDING + 'a');
+	str += (9 - (from.row - g_chess::Board::SINGLE_ROW_PADDING) + '0');
+	str += (to.col - g_chess::Board::SINGLE_COL_PADDING + 'a');
+	str += (9 - (to.row - g_chess::Board::SINGLE_ROW_PADDING) + '0');
+
+	return str;
+}
+
+g_chess::Side checkWinner(const g_chess::Board& bd) {
+	using namespace g_chess;
+
+	bool upAlive = false;
+	bool downAlive = false;
+	Piece p{};
+
+	for (uint32_t r = Board::LINE_UP_9_TOP; r <= Board::LINE_UP_9_BOTTOM; ++r) {
+		for (uint32_t c = Board::LINE_UP_9_LEFT; c <= Board::LINE_UP_9_RIGHT; ++c) {
+			p = bd.get(r, c);
+			if (p == Piece::UG) {
+				upAlive = true;
+			}
+		}
+	}
+
+	for (uint32_t r = Board::LINE_DOWN_9_TOP; r <= Board::LINE_DOWN_9_BOTTOM; ++r) {
+		for (uint32_t c = Board::LINE_DOWN_9_LEFT; c <= Board::LINE_DOWN_9_RIGHT; ++c) {
+			p = bd.get(r, c);
+			if (p == Piece::DG) {
+				downAlive = true;
+			}
+		}
+	}
+
+	if (upAlive && downAlive) {
+		return Side::EXTRA;
+	}
+	else if (upAlive) {
+		return Side::UP;
+	}
+	else {
+		return Side::DOWN;
+	}
+}
+
+void printUsage() {
+	std::cout << R"(usage: gchess [--nnue <file>] [--book <file>] [--tb <dir>] [--stats <file>] [mode]
+modes:
+  (none)                                    play red against the engine on the console
+  ucci                                      UCCI engine for a GUI
+  bench [perft depth=4] [search depth=6]    perft and search benchmark
+  selftest                                  regression checks
+  batch <fen file> <output file> [depth=8] [nodes=0] [threads]
+                                            analyse every FEN of a file
+  match [key=value ...]                     self-play match with SPRT, keys: games time depth threads hash openings
+                                            maxplies elo0 elo1 alpha beta, per engine a.<key> or b.<key>: nullmove
+                                            nullmindepth nullreduction lmr lmrmindepth lmrmoves futility
+                                            futilitydepth futilitymargin nnue
+  book <games file> <book file> [maxply=30] build an opening book
+  tune <positions file> [header=tuned_values.h] [epochs=300] [threads]
+                                            tune the evaluation tables
+  tbgen <dir> <signature>...                generate endgame tables, like RvA or RNvR
+)";
+}
+
+// Numeric arguments and options, false unless the whole text is a number in the range of value.
+template<typename T>
+bool parseNumber(const std::string& str, T& value) {
+	static_assert(std::is_unsigned<T>::value, "counts, depths and sizes are unsigned");
+
+	try {
+		size_t used = 0;
+		unsigned long long v = str.empty() || str[0] == '-' ? 0 : std::stoull(str, &used);
+		if (used == 0 || used != str.size() || v > std::numeric_limits<T>::max()) {
+			return false;
+		}
+
+		value = static_cast<T>(v);
+		return true;
+	}
+	catch (const std::logic_error&) {
+		return false;
+	}
+}
+
+bool parseNumber(const std::string& str, double& value) {
+	try {
+		size_t used = 0;
+		double v = std::stod(str, &used);
+		if (used != str.size()) {
+			return false;
+		}
+
+		value = v;
+		return true;
+	}
+	catch (const std::logic_error&) {
+		return false;
+	}
+}
+
+/*
+	Search statistics log, "--stats <file>" appends one JSON object per search to the file in every mode that searches,
+	so runs of different builds and hosts can be charted side by side. The counters are only kept by an engine compiled
+	with -DGCHESS_STATS. A line, wrapped here, with scores from the side to move:
+		{"build":"Oct 17 2026 12:00:00","fen":"...","threads":1,"depth":8,"score":12,"bestmove":"h2e2","time_ms":153,
+		"nodes":204113,"qnodes":120511,"beta_cutoffs":50120,"first_move_cutoffs":45080,"first_move_cutoff_rate":0.899,
+		"tt_probes":83602,"tt_hits":25312,"tt_hit_rate":0.303,"iterations":[{"depth":1,"score":4,"nodes":45,"time_ms":0,
+		"elapsed_ms":0},...]}
+	time_ms of an iteration is its own time, elapsed_ms the time since the search started.
+*/
+namespace stats {
+	inline double rate(uint64_t part, uint64_t total) {
+		return total == 0 ? 0.0 : static_cast<double>(part) / static_cast<double>(total);
+	}
+
+	class Log {
+	private:
+		std::mutex mutex;
+		std::ofstream out;
+	public:
+		bool open(const std::string& fileName) {
+			out.open(fileName, std::ios::app);
+			return static_cast<bool>(out);
+		}
+
+		void write(const g_chess::Board& bd, g_chess::Side side, const g_chess::SearchResult& result) {
+			using namespace g_chess;
+			const SearchStats& stats = result.stats;
+			const int32_t sign = side == Side::DOWN ? 1 : -1;
+
+			std::ostringstream line;
+			line << std::fixed << std::setprecision(3)
+				<< "{\"build\":\"" << __DATE__ " " __TIME__ << "\",\"fen\":\"" << toFen(bd, side) << "\",\"threads\":" << stats.threads
+				<< ",\"depth\":" << result.depth << ",\"score\":" << sign * result.score
+				<< ",\"bestmove\":\"" << (result.bestMove == Move{} ? "(none)" : moveToStr(result.bestMove)) << "\",\"time_ms\":" << stats.time.count()
+				<< ",\"nodes\":" << result.nodes << ",\"qnodes\":" << stats.qnodes
+				<< ",\"beta_cutoffs\":" << stats.betaCutoffs << ",\"first_move_cutoffs\":" << stats.firstMoveCutoffs
+				<< ",\"first_move_cutoff_rate\":" << rate(stats.firstMoveCutoffs, stats.betaCutoffs)
+				<< ",\"tt_probes\":" << stats.ttProbes << ",\"tt_hits\":" << stats.ttHits << ",\"tt_hit_rate\":" << rate(stats.ttHits, stats.ttProbes)
+				<< ",\"iterations\":[";
+
+			std::chrono::milliseconds prevTime{ 0 };
+			for (size_t i = 0; i < stats.iterations.size(); ++i) {
+				const IterationStats& it = stats.iterations[i];
+				line << (i == 0 ? "" : ",") << "{\"depth\":" << it.depth << ",\"score\":" << sign * it.score << ",\"nodes\":" << it.nodes
+					<< ",\"time_ms\":" << (it.time - prevTime).count() << ",\"elapsed_ms\":" << it.time.count() << "}";
+				prevTime = it.time;
+			}
+			line << "]}\n";
+
+			std::lock_guard<std::mutex> lock{ mutex };
+			out << line.str();
+			out.flush();
+		}
+
+		// Every search run with the config is logged here.
+		void attach(g_chess::SearchConfig& config) {
+			config.onSearch = [this](const g_chess::Board& bd, g_chess::Side side, const g_chess::SearchResult& result) {
+				write(bd, side, result);
+			};
+		}
+	};
+};
+
+/*
+	Headless benchmark, run as "gchess bench [perftDepth] [searchDepth]". It runs perft on both board backends and a
+	fixed-depth single-threaded search from a few standard positions, and returns non-zero when a perft count
+	differs from the known value so regression runs catch move generator changes.
+*/
+namespace bench {
+	constexpr uint32_t KNOWN_PERFT_DEPTH = 4;
+
+	struct Position {
+		const char* name;
+		const char* moves;
+		// Known pseudo-legal and legal perft counts by depth.
+		std::array<uint64_t, KNOWN_PERFT_DEPTH + 1> perft;
+		std::array<uint64_t, KNOWN_PERFT_DEPTH + 1> legalPerft;
+	};
+
+	const Position positions[] = {
+		{ "start", "", { 1, 44, 1926, 80288, 3343298 }, { 1, 44, 1920, 79666, 3290240 } },
+		{ "central cannon", "h2e2 h9g7 h0g2 i9h9 i0h0 b9c7", { 1, 37, 1298, 49552, 1824701 }, { 1, 37, 1292, 49161, 1790186 } },
+		{ "cannon exchange", "b2e2 b7e7 e2e6 e7e3", { 1, 41, 1681, 67157, 2692424 }, { 1, 36, 1309, 46367, 1661349 } },
+		{ "middle game", "h2e2 h9g7 h0g2 i9h9 i0h0 b9c7 b0c2 b7a7 a0b0 a9b9 c3c4 g6g5", { 1, 37, 1358, 52222, 2005818 }, { 1, 37, 1352, 51956, 1973569 } },
+		{ "red palace", "f0e1 h9g7 e1f2 b9c7 e0e1 a9a8 e1e2 i9i8", { 1, 34, 1683, 57873, 2673500 }, { 1, 34, 1683, 57632, 2653369 } },
+	};
+
+	using Clock = std::chrono::steady_clock;
+
+	double secondsSince(Clock::time_point start) {
+		return std::chrono::duration<double>(Clock::now() - start).count();
+	}
+
+	bool setupPosition(const Position& position, g_chess::Board& bd, g_chess::Side& side) {
+		std::istringstream in{ position.moves };
+		std::string input;
+		side = g_chess::Side::DOWN;
+
+		while (in >> input) {
+			if (!isInputValid(input) || !g_chess::isValidMove(bd, inputToMove(input))) {
+				std::cout << "bench: bad move " << input << " in position " << position.name << "\n";
+				return false;
+			}
+
+			bd.move(inputToMove(input));
+			side = g_chess::p_util::getReverseSide(side);
+		}
+
+		return true;
+	}
+
+	uint64_t perftLegalFor(g_chess::Side side, g_chess::Board& bd, uint32_t depth) {
+		return side == g_chess::Side::UP ? g_chess::perftLegal<g_chess::Side::UP>(bd, depth) : g_chess::perftLegal<g_chess::Side::DOWN>(bd, depth);
+	}
+
+	template<typename BoardT>
+	uint64_t perftFor(g_chess::Side side, BoardT& bd, uint32_t depth) {
+		return side == g_chess::Side::UP ? g_chess::perft<g_chess::Side::UP>(bd, depth) : g_chess::perft<g_chess::Side::DOWN>(bd, depth);
+	}
+
+	g_chess::SearchResult searchFor(g_chess::Side side, g_chess::Board& bd, g_chess::TransTable& tt, const g_chess::SearchLimits& limits,
+		const g_chess::SearchConfig& config) {
+		return side == g_chess::Side::UP ? g_chess::searchBestMove<g_chess::Side::UP>(bd, tt, limits, 1, config)
+			: g_chess::searchBestMove<g_chess::Side::DOWN>(bd, tt, limits, 1, config);
+	}
+
+	int run(uint32_t perftDepth, uint32_t searchDepth, const g_chess::nnue::Network* network, stats::Log* statsLog) {
+		using namespace g_chess;
+		bool ok = true;
+		uint64_t perftNodes[2] = {};
+		double perftTime[2] = {};
+		uint64_t searchNodes = 0;
+		double searchTime = 0;
+		TransTable tt;
+		SearchConfig config;
+		if (statsLog != nullptr) {
+			statsLog->attach(config);
+		}
+
+		for (const auto& position : positions) {
+			Board bd;
+			Side side{};
+
+			if (!setupPosition(position, bd, side)) {
+				return 1;
+			}
+
+			bitboard::BitBoard bb{ bd };
+			uint64_t counts[2] = {};
+
+			for (uint32_t backend = 0; backend < 2; ++backend) {
+				auto start = Clock::now();
+				counts[backend] = backend == 0 ? perftFor(side, bd, perftDepth) : perftFor(side, bb, perftDepth);
+				double seconds = secondsSince(start);
+
+				perftNodes[backend] += counts[backend];
+				perftTime[backend] += seconds;
+				std::cout << "perft " << position.name << (backend == 0 ? " mailbox" : " bitboard") << " depth " << perftDepth
+					<< " nodes " << counts[backend] << " time " << seconds << "s nps " << static_cast<uint64_t>(counts[backend] / std::max(seconds, 1e-9)) << "\n";
+			}
+
+			if (counts[0] != counts[1] || (perftDepth <= KNOWN_PERFT_DEPTH && counts[0] != position.perft[perftDepth])) {
+				std::cout << "perft " << position.name << " MISMATCH, expected " << (perftDepth <= KNOWN_PERFT_DEPTH ? position.perft[perftDepth] : counts[1]) << "\n";
+				ok = false;
+			}
+
+			auto legalStart = Clock::now();
+			uint64_t legalCount = perftLegalFor(side, bd, perftDepth);
+			double legalSeconds = secondsSince(legalStart);
+
+			std::cout << "perft " << position.name << " legal depth " << perftDepth << " nodes " << legalCount << " time " << legalSeconds
+				<< "s nps " << static_cast<uint64_t>(legalCount / std::max(legalSeconds, 1e-9)) << "\n";
+
+			if (perftDepth <= KNOWN_PERFT_DEPTH && legalCount != position.legalPerft[perftDepth]) {
+				std::cout << "perft " << position.name << " legal MISMATCH, expected " << position.legalPerft[perftDepth] << "\n";
+				ok = false;
+			}
+
+			SearchLimits limits;
+			limits.maxDepth = searchDepth;
+			tt.clear();
+			bd.setNetwork(network);
+
+			auto start = Clock::now();
+			SearchResult result = searchFor(side, bd, tt, limits, config);
+			double seconds = secondsSince(start);
+
+			searchNodes += result.nodes;
+			searchTime += seconds;
+			std::cout << "search " << position.name << " depth " << result.depth << " best " << moveToStr(result.bestMove) << " score " << result.score
+				<< " nodes " << result.nodes << " time " << seconds << "s nps " << static_cast<uint64_t>(result.nodes / std::max(seconds, 1e-9)) << "\n";
+		}
+
+		std::cout << "total perft mailbox nps " << static_cast<uint64_t>(perftNodes[0] / std::max(perftTime[0], 1e-9))
+			<< " bitboard nps " << static_cast<uint64_t>(perftNodes[1] / std::max(perftTime[1], 1e-9)) << "\n";
+		std::cout << "total search nodes " << searchNodes << " time " << searchTime << "s nps " << static_cast<uint64_t>(searchNodes / std::max(searchTime, 1e-9)) << "\n";
+
+		return ok ? 0 : 1;
+	}
+};
+
+/*
+	Offline Texel tuner for value::pieceValueMap and value::posValueMap, run as
+	"gchess tune <positions file> [header=tuned_values.h] [epochs=300] [threads]". Each line of the positions file is a
+	FEN followed by the game result from red's (DOWN's) view: 1-0, 0-1, 1/2-1/2 or 1, 0, 0.5, brackets and quotes
+	allowed. The positions are scored by the static evaluation, so they should be quiet ones.
+
+	The board score is linear in the table entries, so a position is kept as its list of signed table indices only, a
+	few dozen bytes instead of a Board, and every pass streams over them on all threads. The UP tables are the DOWN
+	ones upside down and negated, like the hand-written ones, so only the DOWN tables are tuned, all but the general
+	material value. The loss is the mean squared error of sigmoid(k * score) against the result, k is fitted to the
+	current tables first and the tables are then fitted with Adam.
+
+	Compiling the engine with -DGCHESS_VALUES_HEADER='"tuned_values.h"' replaces the built-in tables by the output.
+*/
+namespace tune {
+	constexpr uint32_t TYPE_NUM = 7;
+	constexpr uint32_t SQUARE_NUM = g_chess::Board::ROW_NUM * g_chess::Board::COL_NUM;
+	// Weights are the material value of each type, then the DOWN piece-square table of each type.
+	constexpr uint32_t PST_BEGIN = TYPE_NUM;
+	constexpr uint32_t WEIGHT_NUM = PST_BEGIN + TYPE_NUM * SQUARE_NUM;
+	// Feature flag of an UP piece, it counts against the score.
+	constexpr uint16_t NEGATIVE = 0x8000;
+
+	using Weights = std::vector<double>;
+
+	struct DataSet {
+		// Features of all positions back to back, type * 90 + square seen from DOWN, NEGATIVE for UP pieces.
+		std::vector<uint16_t> features;
+		// Position i has the features from offsets[i] to offsets[i + 1].
+		std::vector<uint64_t> offsets{ 0 };
+		// Results from DOWN's view in half points.
+		std::vector<uint8_t> results;
+
+		size_t size() const noexcept { return results.size(); }
+	};
+
+	uint16_t featureOf(g_chess::Piece p, uint32_t sq90) noexcept {
+		using namespace g_chess;
+		uint32_t type = static_cast<uint32_t>(p_util::getType(p));
+
+		if (p_util::getSide(p) == Side::DOWN) {
+			return static_cast<uint16_t>(type * SQUARE_NUM + sq90);
+		}
+
+		uint32_t mirrored = (Board::ROW_NUM - 1 - sq90 / Board::COL_NUM) * Board::COL_NUM + sq90 % Board::COL_NUM;
+		return static_cast<uint16_t>(NEGATIVE | (type * SQUARE_NUM + mirrored));
+	}
+
+	bool parseResult(std::string token, uint8_t& halfPoints) {
+		token.erase(std::remove_if(token.begin(), token.end(), [](char c) { return c == '[' || c == ']' || c == '"'; }), token.end());
+
+		if (token == "1-0" || token == "1" || token == "1.0") {
+			halfPoints = 2;
+		}
+		else if (token == "0-1" || token == "0" || token == "0.0") {
+			halfPoints = 0;
+		}
+		else if (token == "1/2-1/2" || token == "0.5") {
+			halfPoints = 1;
+		}
+		else {
+			return false;
+		}
+
+		return true;
+	}
+
+	bool load(const std::string& fileName, DataSet& data) {
+		std::ifstream in{ fileName };
+		std::string line;
+		size_t skipped = 0;
+
+		if (!in) {
+			return false;
+		}
+
+		while (std::getline(in, line)) {
+			size_t last = line.find_last_not_of(" \t\r");
+			size_t split = last == std::string::npos ? std::string::npos : line.find_last_of(" \t", last);
+			std::array<g_chess::Piece, SQUARE_NUM> squares;
+			g_chess::Side side{};
+			uint8_t result = 0;
+
+			if (split == std::string::npos || !parseResult(line.substr(split + 1, last - split), result)
+				|| !g_chess::fen::parse(line.substr(0, split), squares, side)) {
+				skipped += !line.empty();
+				continue;
+			}
+
+			for (uint32_t sq = 0; sq < SQUARE_NUM; ++sq) {
+				if (squares[sq] != g_chess::Piece::EE) {
+					data.features.push_back(featureOf(squares[sq], sq));
+				}
+			}
+
+			data.offsets.push_back(data.features.size());
+			data.results.push_back(result);
+		}
+
+		std::cout << "loaded " << data.size() << " positions, skipped " << skipped << " bad lines\n";
+		return true;
+	}
+
+	Weights initialWeights() {
+		using namespace g_chess;
+		Weights w(WEIGHT_NUM);
+		const uint32_t down = p_util::pieceToInt32(Piece::DP);
+
+		for (uint32_t t = 0; t < TYPE_NUM; ++t) {
+			w[t] = value::pieceValueMap[down + t];
+			for (uint32_t sq = 0; sq < SQUARE_NUM; ++sq) {
+				w[PST_BEGIN + t * SQUARE_NUM + sq] = value::posValueMap[down + t][sq / Board::COL_NUM][sq % Board::COL_NUM];
+			}
+		}
+
+		return w;
+	}
+
+	inline double scoreOf(const DataSet& data, const Weights& w, size_t i) noexcept {
+		double score = 0;
+
+		for (uint64_t f = data.offsets[i]; f < data.offsets[i + 1]; ++f) {
+			uint32_t index = data.features[f] & ~NEGATIVE;
+			double value = w[index / SQUARE_NUM] + w[PST_BEGIN + index];
+			score += (data.features[f] & NEGATIVE) ? -value : value;
+		}
+
+		return score;
+	}
+
+	inline double sigmoid(double k, double score) noexcept {
+		return 1.0 / (1.0 + std::exp(-k * score));
+	}
+
+	// Runs f(begin, end, thread) over equal slices of the positions, one per thread.
+	template<typename F>
+	void parallelFor(size_t n, uint32_t threadNum, F f) {
+		std::vector<std::thread> threads;
+
+		for (uint32_t t = 0; t < threadNum; ++t) {
+			threads.emplace_back(f, n * t / threadNum, n * (t + 1) / threadNum, t);
+		}
+
+		for (auto& th : threads) {
+			th.join();
+		}
+	}
+
+	/*
+		Mean squared error of the data set, the gradient over the weights is added to grad when it isn't null. Every
+		thread accumulates into its own gradient, they are summed at the end.
+	*/
+	double evaluate(const DataSet& data, const Weights& w, double k, uint32_t threadNum, Weights* grad) {
+		std::vector<double> losses(threadNum);
+		std::vector<Weights> grads(grad != nullptr ? threadNum : 0, Weights(WEIGHT_NUM));
+		const double n = static_cast<double>(std::max<size_t>(data.size(), 1));
+
+		parallelFor(data.size(), threadNum, [&](size_t begin, size_t end, uint32_t t) {
+			double loss = 0;
+
+			for (size_t i = begin; i < end; ++i) {
+				double s = sigmoid(k, scoreOf(data, w, i));
+				double error = s - data.results[i] * 0.5;
+				loss += error * error;
+
+				if (grad == nullptr) {
+					continue;
+				}
+
+				double d = 2 * error * s * (1 - s) * k / n;
+				for (uint64_t f = data.offsets[i]; f < data.offsets[i + 1]; ++f) {
+					uint32_t index = data.features[f] & ~NEGATIVE;
+					double signedD = (data.features[f] & NEGATIVE) ? -d : d;
+					grads[t][index / SQUARE_NUM] += signedD;
+					grads[t][PST_BEGIN + index] += signedD;
+				}
+			}
+
+			losses[t] = loss;
+		});
+
+		if (grad != nullptr) {
+			for (const auto& g : grads) {
+				std::transform(grad->begin(), grad->end(), g.begin(), grad->begin(), std::plus<double>{});
+			}
+		}
+
+		return std::accumulate(losses.begin(), losses.end(), 0.0) / n;
+	}
+
+	// Golden section search for the k with the lowest loss, on a log scale since the best one depends on the score units.
+	double fitK(const DataSet& data, const Weights& w, uint32_t threadNum) {
+		const double phi = (std::sqrt(5.0) - 1) / 2;
+		double lo = std::log(1e-5), hi = std::log(1.0);
+		double a = hi - phi * (hi - lo), b = lo + phi * (hi - lo);
+		double la = evaluate(data, w, std::exp(a), threadNum, nullptr);
+		double lb = evaluate(data, w, std::exp(b), threadNum, nullptr);
+
+		for (uint32_t i = 0; i < 40; ++i) {
+			if (la < lb) {
+				hi = b;
+				b = a;
+				lb = la;
+				a = hi - phi * (hi - lo);
+				la = evaluate(data, w, std::exp(a), threadNum, nullptr);
+			}
+			else {
+				lo = a;
+				a = b;
+				la = lb;
+				b = lo + phi * (hi - lo);
+				lb = evaluate(data, w, std::exp(b), threadNum, nullptr);
+			}
+		}
+
+		return std::exp((lo + hi) / 2);
+	}
+
+	void writeTable(std::ostream& out, const Weights& w, g_chess::Piece p, uint32_t indent) {
+		using namespace g_chess;
+		const std::string tabs(indent, '\t');
+		const uint32_t t = static_cast<uint32_t>(p_util::getType(p));
+		const bool up = p_util::getSide(p) == Side::UP;
+
+		out << tabs << "{\n";
+		for (uint32_t r = 0; r < Board::ROW_NUM; ++r) {
+			out << tabs << "\t{";
+			for (uint32_t c = 0; c < Board::COL_NUM; ++c) {
+				long v = 0;
+				if (p != Piece::EE) {
+					uint32_t sq = (up ? Board::ROW_NUM - 1 - r : r) * Board::COL_NUM + c;
+					v = std::lround(w[PST_BEGIN + t * SQUARE_NUM + sq]) * (up ? -1 : 1);
+				}
+				out << (c == 0 ? " " : ", ") << std::setw(4) << v;
+			}
+			out << " }" << (r + 1 < Board::ROW_NUM ? "," : "") << "\n";
+		}
+		out << tabs << "}";
+	}
+
+	bool writeHeader(const std::string& fileName, const Weights& w, size_t positions, double loss) {
+		using namespace g_chess;
+		std::ofstream out{ fileName };
+
+		if (!out) {
+			return false;
+		}
+
+		out << "/*\n\tGenerated by \"gchess tune\" from " << positions << " positions, loss " << loss << ".\n"
+			<< "\tIncluded inside namespace g_chess in place of the built-in tables, see GCHESS_VALUES_HEADER.\n*/\n";
+		out << "namespace value {\n\tconstexpr int32_t pieceValueMap[] = {\n";
+		for (Side side : { Side::UP, Side::DOWN }) {
+			out << "\t\t";
+			for (uint32_t t = 0; t < TYPE_NUM; ++t) {
+				long v = std::lround(w[t]) * (side == Side::UP ? -1 : 1);
+				out << std::showpos << std::setw(4) << v << std::noshowpos << (t + 1 < TYPE_NUM ? ", " : ",\n");
+			}
+		}
+		out << "\t\t   0,    0\n\t};\n\n";
+
+		out << "\tconstexpr int32_t posValueMap[][Board::ROW_NUM][Board::COL_NUM] = {\n";
+		for (uint32_t p = p_util::pieceToInt32(Piece::UP); p <= p_util::pieceToInt32(Piece::EE); ++p) {
+			out << "\t\t// " << (p == p_util::pieceToInt32(Piece::EE) ? "EE" : std::string{ p < 7 ? 'U' : 'D', "PCRNBAG"[p % 7] }) << "\n";
+			writeTable(out, w, static_cast<Piece>(p), 2);
+			out << (p < p_util::pieceToInt32(Piece::EE) ? ",\n" : "\n");
+		}
+		out << "\t};\n};\n";
+
+		return static_cast<bool>(out);
+	}
+
+	int run(const std::string& dataFile, const std::string& headerFile, uint32_t epochs, uint32_t threadNum) {
+		DataSet data;
+
+		if (!load(dataFile, data) || data.size() == 0) {
+			std::cout << "tune: can't read positions from " << dataFile << "\n";
+			return 1;
+		}
+
+		Weights w = initialWeights();
+		double k = fitK(data, w, threadNum);
+		double loss = evaluate(data, w, k, threadNum, nullptr);
+		std::cout << "k " << k << " initial loss " << loss << "\n";
+
+		// Adam, the step is about LEARNING_RATE score units per epoch at first.
+		constexpr double LEARNING_RATE = 1.0, BETA1 = 0.9, BETA2 = 0.999, EPSILON = 1e-8;
+		const uint32_t general = static_cast<uint32_t>(g_chess::Type::GENERAL);
+		Weights m(WEIGHT_NUM), v(WEIGHT_NUM);
+
+		for (uint32_t epoch = 1; epoch <= epochs; ++epoch) {
+			Weights grad(WEIGHT_NUM);
+			loss = evaluate(data, w, k, threadNum, &grad);
+			grad[general] = 0;
+
+			for (uint32_t i = 0; i < WEIGHT_NUM; ++i) {
+				m[i] = BETA1 * m[i] + (1 - BETA1) * grad[i];
+				v[i] = BETA2 * v[i] + (1 - BETA2) * grad[i] * grad[i];
+				double mHat = m[i] / (1 - std::pow(BETA1, epoch));
+				double vHat = v[i] / (1 - std::pow(BETA2, epoch));
+				w[i] -= LEARNING_RATE * mHat / (std::sqrt(vHat) + EPSILON);
+			}
+
+			if (epoch % 10 == 0 || epoch == epochs) {
+				std::cout << "epoch " << epoch << " loss " << loss << "\n";
+			}
+		}
+
+		loss = evaluate(data, w, k, threadNum, nullptr);
+		if (!writeHeader(headerFile, w, data.size(), loss)) {
+			std::cout << "tune: can't write " << headerFile << "\n";
+			return 1;
+		}
+
+		std::cout << "final loss " << loss << ", tables written to " << headerFile << "\n";
+		return 0;
+	}
+};
+
+/*
+	UCCI engine front end, run as "gchess ucci" or entered by typing "ucci" as the first move of the console game, the
+	way GUIs start an engine. Nothing is rendered, the board only changes through position commands.
+
+	Supported: ucci, isready, setoption (hashsize, threads, clearhash, newgame, bookfiles), position {startpos | fen <fen>}
+	[moves ...], go [ponder | infinite] {depth | nodes | time [movestogo | increment] | movetime}, stop, ponderhit and
+	quit. The search runs on a worker thread and polls the stop signal with its node counter, so stop is answered
+	within a few thousand nodes. A position the opening book knows is answered at once, except for go ponder and
+	go infinite. After go ponder or go infinite the best move is held back until stop or ponderhit,
+	on ponderhit the clock starts for the budget the go command gave. Scores are from the side to move.
+*/
+namespace ucci {
+	// Moves the remaining time is spread over when the GUI doesn't say.
+	constexpr uint32_t DEFAULT_MOVES_TO_GO = 30;
+	// Kept back from the remaining time for the GUI and the pipes.
+	constexpr std::chrono::milliseconds TIME_MARGIN{ 50 };
+
+	class Engine {
+	private:
+		g_chess::Board bd;
+		g_chess::Side side;
+		g_chess::TransTable tt;
+		const g_chess::nnue::Network* network;
+		uint32_t threadNum;
+		g_chess::SearchConfig config;
+		g_chess::OpeningBook ownBook;
+		const g_chess::OpeningBook* book;
+		std::mt19937_64 rng;
+
+		std::thread worker;
+		std::thread timer;
+		std::atomic<bool> stopSignal;
+		std::chrono::steady_clock::time_point startTime;
+		std::mutex outputMutex;
+
+		// Guarded by stateMutex. While holding, a finished search keeps its best move until stop or ponderhit.
+		std::mutex stateMutex;
+		std::condition_variable stateChanged;
+		bool searching;
+		bool holding;
+		std::chrono::milliseconds ponderBudget;
+	private:
+		void send(const std::string& line) {
+			std::lock_guard<std::mutex> lock{ outputMutex };
+			std::cout << line << std::endl;
+		}
+
+		void sendInfo(const g_chess::SearchResult& result) {
+			auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+			std::ostringstream out;
+
+			out << "info depth " << result.depth << " score " << (side == g_chess::Side::DOWN ? result.score : -result.score)
+				<< " time " << ms << " nodes " << result.nodes << " nps " << result.nodes * 1000 / std::max<int64_t>(ms, 1)
+				<< " hashfull " << tt.hashfull() << " pv";
+			for (const auto& m : result.pv) {
+				out << " " << moveToStr(m);
+			}
+
+			send(out.str());
+		}
+
+		// Stops a running search, lets it report its move and waits for the worker.
+		void finishSearch() {
+			stopSignal = true;
+			{
+				std::lock_guard<std::mutex> lock{ stateMutex };
+				holding = false;
+			}
+			stateChanged.notify_all();
+
+			if (worker.joinable()) {
+				worker.join();
+			}
+			if (timer.joinable()) {
+				timer.join();
+			}
+			stopSignal = false;
+		}
+
+		// Stops the search once the budget has passed, unless it finishes first.
+		void startTimer(std::chrono::milliseconds budget) {
+			timer = std::thread([this, budget]() {
+				std::unique_lock<std::mutex> lock{ stateMutex };
+				if (!stateChanged.wait_for(lock, budget, [this]() { return !searching; })) {
+					stopSignal = true;
+				}
+			});
+		}
+
+		// The position is built on a scratch board and only replaces the current one when the FEN and every move are valid.
+		void setPosition(std::istringstream& in) {
+			using namespace g_chess;
+			std::string token, fenStr;
+			Board next;
+			Side nextSide = Side::DOWN;
+
+			in >> token;
+			if (token == "fen") {
+				while (in >> token && token != "moves") {
+					fenStr += token + " ";
+				}
+
+				if (!setFen(next, fenStr, nextSide)) {
+					send("info string bad fen, position unchanged: " + fenStr);
+					return;
+				}
+			}
+			else if (token == "startpos") {
+				in >> token;
+			}
+			else {
+				send("info string bad position command, position unchanged");
+				return;
+			}
+
+			next.setNetwork(network);
+			if (token == "moves") {
+				while (in >> token) {
+					Move m = isInputValid(token) ? inputToMove(token) : Move{};
+					if (m == Move{} || p_util::getSide(next.get(m.from())) != nextSide || !isValidMove(next, m)) {
+						send("info string illegal move " + token + ", position unchanged");
+						return;
+					}
+
+					next.move(m);
+					nextSide = p_util::getReverseSide(nextSide);
+				}
+			}
+
+			bd = next;
+			side = nextSide;
+		}
+
+		void go(std::istringstream& in) {
+			using namespace g_chess;
+			std::string token;
+			SearchLimits limits;
+			bool ponder = false, infinite = false;
+			int64_t time = 0, increment = 0, movesToGo = 0, moveTime = 0;
+
+			while (in >> token) {
+				if (token == "ponder") {
+					ponder = true;
+				}
+				else if (token == "infinite") {
+					infinite = true;
+				}
+				else if (token == "depth") {
+					in >> limits.maxDepth;
+					limits.maxDepth = std::max(1u, std::min(limits.maxDepth, MAX_PLY - 1));
+				}
+				else if (token == "nodes") {
+					in >> limits.maxNodes;
+				}
+				else if (token == "time") {
+					in >> time;
+				}
+				else if (token == "increment") {
+					in >> increment;
+				}
+				else if (token == "movestogo") {
+					in >> movesToGo;
+				}
+				else if (token == "movetime") {
+					in >> moveTime;
+				}
+			}
+
+			std::chrono::milliseconds budget{ moveTime };
+			if (time > 0) {
+				int64_t share = movesToGo > 0 ? time / movesToGo : time / DEFAULT_MOVES_TO_GO + increment;
+				budget = std::chrono::milliseconds{ std::max<int64_t>(1, std::min(share, time - TIME_MARGIN.count())) };
+			}
+
+			if (book != nullptr && !ponder && !infinite) {
+				Move m = side == Side::UP ? book->probe<Side::UP>(bd, rng()) : book->probe<Side::DOWN>(bd, rng());
+				if (m != Move{}) {
+					send("info string book move");
+					send("bestmove " + moveToStr(m));
+					return;
+				}
+			}
+
+			startTime = std::chrono::steady_clock::now();
+			limits.stopSignal = &stopSignal;
+			limits.onIteration = [this](const SearchResult& result) { sendInfo(result); };
+			if (!ponder && !infinite) {
+				limits.moveTime = budget;
+			}
+
+			{
+				std::lock_guard<std::mutex> lock{ stateMutex };
+				searching = true;
+				holding = ponder || infinite;
+				ponderBudget = ponder ? budget : std::chrono::milliseconds{ 0 };
+			}
+
+			worker = std::thread([this, limits]() {
+				SearchResult result = side == Side::UP ? searchBestMove<Side::UP>(bd, tt, limits, threadNum, config)
+					: searchBestMove<Side::DOWN>(bd, tt, limits, threadNum, config);
+				{
+					std::unique_lock<std::mutex> lock{ stateMutex };
+					searching = false;
+					stateChanged.notify_all();
+					stateChanged.wait(lock, [this]() { return !holding; });
+				}
+
+				if (result.bestMove == Move{}) {
+					send("nobestmove");
+				}
+				else {
+					send("bestmove " + moveToStr(result.bestMove) + (result.pv.size() > 1 ? " ponder " + moveToStr(result.pv[1]) : ""));
+				}
+			});
+		}
+
+		void ponderhit() {
+			std::lock_guard<std::mutex> lock{ stateMutex };
+			if (!holding || ponderBudget.count() == 0) {
+				holding = false;
+				stateChanged.notify_all();
+				return;
+			}
+
+			holding = false;
+			stateChanged.notify_all();
+			if (searching && !timer.joinable()) {
+				startTimer(ponderBudget);
+			}
+		}
+
+		void setOption(std::istringstream& in) {
+			std::string name;
+			uint32_t value = 0;
+
+			in >> name;
+			if (name == "hashsize" && in >> value) {
+				tt.resize(std::max(1u, value));
+			}
+			else if (name == "threads" && in >> value) {
+				threadNum = std::max(1u, value);
+			}
+			else if (name == "clearhash" || name == "newgame") {
+				tt.clear();
+			}
+			else if (name == "bookfiles") {
+				std::string file;
+				std::getline(in >> std::ws, file);
+				book = ownBook.open(file) ? &ownBook : nullptr;
+				if (book == nullptr) {
+					send("info string can't open book " + file);
+				}
+			}
+		}
+	public:
+		Engine(const g_chess::nnue::Network* net, const g_chess::OpeningBook* _book, const g_chess::tablebase::Tablebases* tablebases, stats::Log* statsLog) :
+			bd{}, side(g_chess::Side::DOWN), tt{}, network(net), threadNum(1), config{}, ownBook{}, book(_book), rng{ std::random_device{}() }, worker{}, timer{}, stopSignal(false),
+			startTime{}, outputMutex{}, stateMutex{}, stateChanged{}, searching(false), holding(false), ponderBudget{ 0 }
+		{
+			bd.setNetwork(network);
+			config.tablebases = tablebases;
+			if (statsLog != nullptr) {
+				statsLog->attach(config);
+			}
+		}
+
+		~Engine() {
+			finishSearch();
+		}
+
+		// Returns false on quit.
+		bool handle(const std::string& line) {
+			std::istringstream in{ line };
+			std::string command;
+			in >> command;
+
+			if (command == "ucci") {
+				send("id name gchess");
+				send("option hashsize type spin min 1 max 65536 default " + std::to_string(g_chess::TransTable::DEFAULT_SIZE_MB));
+				send("option threads type spin min 1 max 256 default 1");
+				send("option clearhash type button");
+				send("option bookfiles type string default <empty>");
+				send("ucciok");
+			}
+			else if (command == "isready") {
+				send("readyok");
+			}
+			else if (command == "setoption") {
+				finishSearch();
+				setOption(in);
+			}
+			else if (command == "position") {
+				finishSearch();
+				setPosition(in);
+			}
+			else if (command == "go") {
+				finishSearch();
+				go(in);
+			}
+			else if (command == "stop") {
+				finishSearch();
+			}
+			else if (command == "ponderhit") {
+				ponderhit();
+			}
+			else if (command == "quit") {
+				finishSearch();
+				send("bye");
+				return false;
+			}
+
+			return true;
+		}
+	};
+
+	int run(const g_chess::nnue::Network* network, const g_chess::OpeningBook* book, const g_chess::tablebase::Tablebases* tablebases, stats::Log* statsLog,
+		bool greeted) {
+		Engine engine{ network, book, tablebases, statsLog };
+		std::string line;
+
+		if (greeted) {
+			engine.handle("ucci");
+		}
+
+		while (std::getline(std::cin, line) && engine.handle(line)) {
+		}
+
+		return 0;
+	}
+};
+
+/*
+	Offline analysis of a file of positions, run as "gchess batch <fen file> <output file> [depth=8] [nodes=0] [threads]".
+	Every line holding a FEN is searched to the depth, or the node count when it isn't zero, by a single-threaded
+	search with its own cleared table, so a position always gets the same result however the work was spread.
+
+	Positions are dealt in contiguous blocks to per-worker queues. A worker takes from the front of its own queue and,
+	once that is empty, steals from the back of another one, so a block of slow positions doesn't leave the other
+	cores idle. Each worker owns its Board and TransTable. Results are written in input order as soon as all earlier
+	ones are done, one line per position:
+		<fen> TAB bestmove <move> score <score> depth <depth> nodes <nodes> pv <moves>
+	with the score from the side to move.
+*/
+namespace batch {
+	// Per-worker table size, a batch runs one search per core.
+	constexpr size_t WORKER_TT_SIZE_MB = 16;
+
+	class WorkQueues {
+	private:
+		struct Queue {
+			std::mutex mutex;
+			std::deque<size_t> tasks;
+		};
+
+		std::vector<Queue> queues;
+	public:
+		WorkQueues(size_t taskNum, uint32_t workerNum) : queues(workerNum) {
+			for (uint32_t w = 0; w < workerNum; ++w) {
+				for (size_t t = taskNum * w / workerNum; t < taskNum * (w + 1) / workerNum; ++t) {
+					queues[w].tasks.push_back(t);
+				}
+			}
+		}
+
+		bool pop(uint32_t worker, size_t& task) {
+			for (uint32_t i = 0; i < queues.size(); ++i) {
+				Queue& q = queues[(worker + i) % queues.size()];
+				std::lock_guard<std::mutex> lock{ q.mutex };
+
+				if (!q.tasks.empty()) {
+					if (i == 0) {
+						task = q.tasks.front();
+						q.tasks.pop_front();
+					}
+					else {
+						task = q.tasks.back();
+						q.tasks.pop_back();
+					}
+					return true;
+				}
+			}
+
+			return false;
+		}
+	};
+
+	// Collects finished lines and writes out the longest finished prefix.
+	class OrderedWriter {
+	private:
+		std::ostream& out;
+		std::mutex mutex;
+		std::vector<std::string> lines;
+		std::vector<bool> done;
+		size_t next;
+	public:
+		OrderedWriter(std::ostream& _out, size_t lineNum) : out(_out), mutex{}, lines(lineNum), done(lineNum, false), next(0) {}
+
+		void write(size_t index, std::string line) {
+			std::lock_guard<std::mutex> lock{ mutex };
+			lines[index] = std::move(line);
+			done[index] = true;
+
+			for (; next < lines.size() && done[next]; ++next) {
+				out << lines[next] << "\n";
+				std::string{}.swap(lines[next]);
+			}
+			out.flush();
+		}
 	};
 
-	inline int32_t getPieceValue(Piece p) {
-		return value::pieceValueMap[p_util::pieceToInt32(p)];
+	std::string analyse(g_chess::Board& bd, g_chess::TransTable& tt, const std::string& fenStr, const g_chess::SearchLimits& limits,
+		const g_chess::SearchConfig& config, uint64_t& nodes) {
+		using namespace g_chess;
+		Side side{};
+
+		if (!setFen(bd, fenStr, side)) {
+			return fenStr + "\terror bad fen";
+		}
+
+		tt.clear();
+		SearchResult result = side == Side::UP ? searchBestMove<Side::UP>(bd, tt, limits, 1, config) : searchBestMove<Side::DOWN>(bd, tt, limits, 1, config);
+		nodes += result.nodes;
+
+		std::ostringstream out;
+		out << toFen(bd, side) << "\tbestmove " << (result.bestMove == Move{} ? "(none)" : moveToStr(result.bestMove))
+			<< " score " << (side == Side::DOWN ? result.score : -result.score) << " depth " << result.depth << " nodes " << result.nodes << " pv";
+		for (const auto& m : result.pv) {
+			out << " " << moveToStr(m);
+		}
+
+		return out.str();
 	}
 
-	inline int32_t getPiecePosValue(Piece p, const Pos& pos) {
-		return value::posValueMap[p_util::pieceToInt32(p)][pos.row - Board::SINGLE_ROW_PADDING][pos.col - Board::SINGLE_COL_PADDING];
+	int run(const std::string& inputFile, const std::string& outputFile, uint32_t depth, uint64_t maxNodes, uint32_t threadNum, const g_chess::nnue::Network* network,
+		const g_chess::tablebase::Tablebases* tablebases, stats::Log* statsLog) {
+		using namespace g_chess;
+		std::ifstream in{ inputFile };
+		std::ofstream out{ outputFile };
+		std::vector<std::string> fens;
+		std::string line;
+
+		if (!in || !out) {
+			std::cout << "batch: can't open " << (!in ? inputFile : outputFile) << "\n";
+			return 1;
+		}
+
+		while (std::getline(in, line)) {
+			if (line.find_first_not_of(" \t\r") != std::string::npos) {
+				fens.push_back(line);
+			}
+		}
+
+		SearchLimits limits;
+		limits.maxDepth = std::max(1u, std::min(depth, MAX_PLY - 1));
+		limits.maxNodes = maxNodes;
+		SearchConfig config;
+		config.tablebases = tablebases;
+		if (statsLog != nullptr) {
+			statsLog->attach(config);
+		}
+
+		threadNum = static_cast<uint32_t>(std::max<size_t>(1, std::min<size_t>(threadNum, fens.size())));
+		WorkQueues queues{ fens.size(), threadNum };
+		OrderedWriter writer{ out, fens.size() };
+		std::atomic<uint64_t> totalNodes{ 0 };
+		std::vector<std::thread> workers;
+		auto start = std::chrono::steady_clock::now();
+
+		for (uint32_t w = 0; w < threadNum; ++w) {
+			workers.emplace_back([&, w]() {
+				Board bd;
+				TransTable tt{ WORKER_TT_SIZE_MB };
+				uint64_t nodes = 0;
+				size_t task = 0;
+
+				bd.setNetwork(network);
+				while (queues.pop(w, task)) {
+					writer.write(task, analyse(bd, tt, fens[task], limits, config, nodes));
+				}
+
+				totalNodes += nodes;
+			});
+		}
+
+		for (auto& worker : workers) {
+			worker.join();
+		}
+
+		double seconds = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), 1e-9);
+		std::cout << "batch: " << fens.size() << " positions on " << threadNum << " threads in " << seconds << "s, "
+			<< fens.size() / seconds << " positions/s, nodes " << totalNodes.load() << " nps " << static_cast<uint64_t>(totalNodes.load() / seconds) << "\n";
+
+		return static_cast<bool>(out) ? 0 : 1;
 	}
+};
 
-	int32_t calcBoardScore(const Board& bd) {
-		int32_t totalScore = 0;
-		Piece p{};
+/*
+	Self-play match between two search configurations, run as "gchess match [key=value ...]", to check that a change
+	really gains strength. Every opening of the suite is played twice with colors swapped, games run concurrently
+	on all cores, each game thread with its own tables, and every engine searches single-threaded.
+
+	A game ends when the side to move has no legal move and loses, on the third repetition of a position, or at the
+	move limit. With --book both engines play book moves while the book knows the position. A repetition is judged by
+	checkRepetition, the side that checked or chased perpetually while the other didn't loses, any other one is a
+	draw, and so is the move limit.
+
+	After each game a GSPRT on the trinomial win/draw/loss model tests elo0 against elo1, from engine A's view, and
+	the match stops as soon as the log-likelihood ratio leaves [log(beta / (1 - alpha)), log((1 - beta) / alpha)].
+
+	Keys, defaults in brackets:
+		games [1000], time per move in ms [100], depth [0, unlimited], threads [all cores], hash per engine in MB [16],
+		openings file, one move list from the start or one FEN per line, bad lines skipped [built-in suite], maxplies [300],
+		elo0 [0], elo1 [10], alpha [0.05], beta [0.05]
+	and per engine, prefixed with "a." or "b.": nullmove, nullmindepth, nullreduction, lmr, lmrmindepth, lmrmoves,
+	futility, futilitydepth, futilitymargin, nnue (a network file). Switches are 0 or 1, lmrmindepth is at least 2,
+	and a value out of range is a bad option.
+	For example "gchess match time=50 b.lmr=0" measures what late move reductions are worth.
+*/
+namespace match {
+	const char* const defaultOpenings[] = {
+		"h2e2 h9g7",
+		"h2e2 b9c7 h0g2 h9g7",
+		"h2e2 h7e7",
+		"b2e2 h9g7",
+		"h2d2 h9g7",
+		"c3c4 g6g5",
+		"g3g4 c6c5",
+		"b0c2 h9g7",
+		"g0e2 h7e7",
+		"c0e2 b9c7",
+	};
 
-		for (uint32_t r = Board::ROW_BEGIN; r < Board::ROW_END; ++r) {
-			for (uint32_t c = Board::COL_BEGIN; c < Board::COL_END; ++c) {
-				p = bd.get(r, c);
+	struct EngineSettings {
+		g_chess::SearchConfig config;
+		const g_chess::nnue::Network* network;
+		std::unique_ptr<g_chess::nnue::Network> ownNetwork;
+
+		EngineSettings() : config{}, network(nullptr), ownNetwork{} {}
+	};
+
+	struct Settings {
+		uint32_t games;
+		g_chess::SearchLimits limits;
+		uint32_t threadNum;
+		size_t hashMb;
+		uint32_t maxPlies;
+		double elo0, elo1, alpha, beta;
+		std::vector<std::string> openings;
+		const g_chess::OpeningBook* book;
+		std::array<EngineSettings, 2> engines;
+
+		Settings() :
+			games(1000), limits{}, threadNum(std::max(1u, std::thread::hardware_concurrency())), hashMb(g_chess::TransTable::DEFAULT_SIZE_MB),
+			maxPlies(300), elo0(0), elo1(10), alpha(0.05), beta(0.05), openings(std::begin(defaultOpenings), std::end(defaultOpenings)), book(nullptr), engines{}
+		{
+			limits.moveTime = std::chrono::milliseconds(100);
+		}
+	};
+
+	bool setEngineOption(EngineSettings& engine, const std::string& key, const std::string& value) {
+		g_chess::SearchConfig& c = engine.config;
 
-				totalScore += getPieceValue(p);
-				totalScore += getPiecePosValue(p, Pos{ r, c });
+		if (key == "nnue") {
+			engine.ownNetwork.reset(new g_chess::nnue::Network{});
+			engine.network = engine.ownNetwork.get();
+			return engine.ownNetwork->load(value);
+		}
+
+		uint32_t v = 0;
+		if (!parseNumber(value, v)) {
+			return false;
+		}
+
+		/*
+			Switches are 0 or 1 and depths stay below MAX_PLY. Reductions need depth 2 to leave a ply to search, and the
+			futility margin times any depth stays below the mate scores.
+		*/
+		using g_chess::MAX_PLY;
+		if (key == "nullmove" && v <= 1) c.nullMove = v != 0;
+		else if (key == "nullmindepth" && v < MAX_PLY) c.nullMoveMinDepth = v;
+		else if (key == "nullreduction" && v < MAX_PLY) c.nullMoveReduction = v;
+		else if (key == "lmr" && v <= 1) c.lateMoveReduction = v != 0;
+		else if (key == "lmrmindepth" && v >= 2 && v < MAX_PLY) c.lmrMinDepth = v;
+		else if (key == "lmrmoves" && v < g_chess::MoveList::MAX_MOVES) c.lmrMinMoveIndex = v;
+		else if (key == "futility" && v <= 1) c.futility = v != 0;
+		else if (key == "futilitydepth" && v < MAX_PLY) c.futilityMaxDepth = v;
+		else if (key == "futilitymargin" && v <= static_cast<uint32_t>(g_chess::MATE_BOUND) / MAX_PLY) c.futilityMargin = static_cast<int32_t>(v);
+		else return false;
+
+		return true;
+	}
+
+	bool setOption(Settings& settings, const std::string& arg) {
+		size_t eq = arg.find('=');
+		if (eq == std::string::npos) {
+			return false;
+		}
+
+		std::string key = arg.substr(0, eq), value = arg.substr(eq + 1);
+
+		if (key.compare(0, 2, "a.") == 0 || key.compare(0, 2, "b.") == 0) {
+			return setEngineOption(settings.engines[key[0] == 'a' ? 0 : 1], key.substr(2), value);
+		}
+
+		if (key == "openings") {
+			std::ifstream in{ value };
+			std::string line;
+
+			settings.openings.clear();
+			while (std::getline(in, line)) {
+				if (line.find_first_not_of(" \t\r") != std::string::npos) {
+					settings.openings.push_back(line);
+				}
 			}
+			return !settings.openings.empty();
 		}
 
-		return totalScore;
+		uint64_t ms = static_cast<uint64_t>(settings.limits.moveTime.count());
+		bool ok = false;
+
+		if (key == "games") ok = parseNumber(value, settings.games);
+		else if (key == "time") ok = parseNumber(value, ms);
+		else if (key == "depth") ok = parseNumber(value, settings.limits.maxDepth);
+		else if (key == "threads") ok = parseNumber(value, settings.threadNum);
+		else if (key == "hash") ok = parseNumber(value, settings.hashMb);
+		else if (key == "maxplies") ok = parseNumber(value, settings.maxPlies);
+		else if (key == "elo0") ok = parseNumber(value, settings.elo0);
+		else if (key == "elo1") ok = parseNumber(value, settings.elo1);
+		else if (key == "alpha") ok = parseNumber(value, settings.alpha);
+		else if (key == "beta") ok = parseNumber(value, settings.beta);
+
+		settings.limits.moveTime = std::chrono::milliseconds(ms);
+		settings.threadNum = std::max(1u, settings.threadNum);
+		return ok;
 	}
 
-	constexpr int32_t MAX_VALUE = std::numeric_limits<int32_t>::max();
-	constexpr int32_t MIN_VALUE = std::numeric_limits<int32_t>::min();
+	// An opening is a FEN when it has a '/', otherwise moves from the start position.
+	bool setupOpening(const std::string& opening, g_chess::Board& bd, g_chess::Side& side) {
+		using namespace g_chess;
 
-	template<Side side>
-	int32_t minMax(Board& bd, uint32_t searchDepth, int32_t alpha, int32_t beta, bool& stopFlag);
+		if (opening.find('/') != std::string::npos) {
+			return setFen(bd, opening, side);
+		}
 
-	template<>
-	int32_t minMax<Side::UP>(Board& bd, uint32_t searchDepth, int32_t alpha, int32_t beta, bool& stopFlag);
+		std::istringstream in{ opening };
+		std::string token;
+		bd = Board{};
+		side = Side::DOWN;
 
-	template<>
-	int32_t minMax<Side::DOWN>(Board& bd, uint32_t searchDepth, int32_t alpha, int32_t beta, bool& stopFlag);
+		while (in >> token) {
+			Move m = isInputValid(token) ? inputToMove(token) : Move{};
+			if (m == Move{} || p_util::getSide(bd.get(m.from())) != side || !isValidMove(bd, m)) {
+				return false;
+			}
 
-	template<>
-	int32_t minMax<Side::UP>(Board& bd, uint32_t searchDepth, int32_t alpha, int32_t beta, bool& stopFlag) {
-		if (searchDepth == 0) {
-			return calcBoardScore(bd);
+			bd.move(m);
+			side = p_util::getReverseSide(side);
 		}
 
-		Moves moves;
-		genMoves<Side::UP>(bd, moves);
-		int32_t minValue = MAX_VALUE;
+		return true;
+	}
 
-		for (const auto& m : moves) {
-			if (stopFlag) {
-				return minValue;
+	// Result from engine A's view in half points.
+	struct GameResult {
+		uint32_t halfPoints;
+		const char* reason;
+	};
+
+	/*
+		Plays one game, engine A is DOWN when aIsDown. tts holds the table of each engine, they are cleared first so
+		a game doesn't depend on the ones played before it on the same thread.
+	*/
+	GameResult playGame(const Settings& settings, const std::string& opening, bool aIsDown, std::array<g_chess::TransTable, 2>& tts) {
+		using namespace g_chess;
+		Board bd;
+		Side side{};
+
+		setupOpening(opening, bd, side);
+		tts[0].clear();
+		tts[1].clear();
+
+		// Key of every position of the game.
+		std::vector<uint64_t> keys{ bd.getKey() };
+
+		for (uint32_t ply = 0; ply < settings.maxPlies; ++ply) {
+			const uint32_t engine = (side == Side::DOWN) == aIsDown ? 0 : 1;
+			const EngineSettings& e = settings.engines[engine];
+			bool hasMove = side == Side::UP ? hasLegalMove<Side::UP>(bd) : hasLegalMove<Side::DOWN>(bd);
+
+			if (!hasMove) {
+				return GameResult{ engine == 0 ? 0u : 2u, "no legal move" };
+			}
+
+			if (bd.getNetwork() != e.network) {
+				bd.setNetwork(e.network);
 			}
 
+			Move m = side == Side::UP ? genBestMoveFor<Side::UP>(bd, tts[engine], settings.limits, 1, e.config, settings.book)
+				: genBestMoveFor<Side::DOWN>(bd, tts[engine], settings.limits, 1, e.config, settings.book);
 			bd.move(m);
-			minValue = std::min(minValue, minMax<Side::DOWN>(bd, searchDepth - 1, alpha, beta, stopFlag));
-			bd.undo();
+			side = p_util::getReverseSide(side);
+			keys.push_back(bd.getKey());
 
-			beta = std::min(beta, minValue);
-			if (alpha >= beta) {
-				return minValue;
+			if (std::count(keys.begin(), keys.end(), keys.back()) < 3) {
+				continue;
 			}
+
+			// Judged on the cycle since the previous occurrence, from the side to move, the engine that didn't just move.
+			Repetition repetition = checkRepetition(bd, side);
+			if (repetition == Repetition::WIN || repetition == Repetition::LOSS) {
+				uint32_t loser = repetition == Repetition::LOSS ? 1 - engine : engine;
+				return GameResult{ loser == 0 ? 0u : 2u, "perpetual check or chase" };
+			}
+
+			return GameResult{ 1, "repetition" };
 		}
 
-		return minValue;
+		return GameResult{ 1, "move limit" };
+	}
+
+	// Logistic Elo of a score fraction.
+	inline double scoreOfElo(double elo) {
+		return 1.0 / (1.0 + std::pow(10.0, -elo / 400.0));
+	}
+
+	inline double eloOfScore(double score) {
+		score = std::min(std::max(score, 1e-6), 1.0 - 1e-6);
+		return -400.0 * std::log10(1.0 / score - 1.0);
 	}
 
-	template<>
-	int32_t minMax<Side::DOWN>(Board& bd, uint32_t searchDepth, int32_t alpha, int32_t beta, bool& stopFlag) {
-		if (searchDepth == 0) {
-			return calcBoardScore(bd);
+	/*
+		Log-likelihood ratio of elo1 against elo0 for the results so far, by the normal approximation of the GSPRT.
+		Half a game is added to each of the win, draw and loss counts, so the variance is never zero and a one-sided
+		result, like a stronger engine that never loses, still reaches a bound.
+	*/
+	double llr(uint32_t wins, uint32_t draws, uint32_t losses, double elo0, double elo1) {
+		if (wins + draws + losses == 0) {
+			return 0;
 		}
 
-		Moves moves;
-		genMoves<Side::DOWN>(bd, moves);
-		int32_t maxValue = MIN_VALUE;
+		const double w = wins + 0.5, d = draws + 0.5, l = losses + 0.5;
+		const double n = w + d + l;
+		const double score = (w + 0.5 * d) / n;
+		const double variance = (w * (1 - score) * (1 - score) + d * (0.5 - score) * (0.5 - score) + l * score * score) / n;
+		const double s0 = scoreOfElo(elo0), s1 = scoreOfElo(elo1);
 
-		for (const auto& m : moves) {
-			if (stopFlag) {
-				return maxValue;
-			}
+		return (s1 - s0) * (2 * score - s0 - s1) * n / (2 * variance);
+	}
 
-			bd.move(m);
-			maxValue = std::max(maxValue, minMax<Side::UP>(bd, searchDepth - 1, alpha, beta, stopFlag));
-			bd.undo();
+	int run(const std::vector<std::string>& args, const g_chess::nnue::Network* network, const g_chess::OpeningBook* book,
+		const g_chess::tablebase::Tablebases* tablebases, stats::Log* statsLog) {
+		Settings settings;
+		settings.book = book;
+		settings.engines[0].network = network;
+		settings.engines[1].network = network;
+		settings.engines[0].config.tablebases = tablebases;
+		settings.engines[1].config.tablebases = tablebases;
+		if (statsLog != nullptr) {
+			statsLog->attach(settings.engines[0].config);
+			statsLog->attach(settings.engines[1].config);
+		}
 
-			alpha = std::max(alpha, maxValue);
-			if (alpha >= beta) {
-				return maxValue;
+		for (const auto& arg : args) {
+			if (!setOption(settings, arg)) {
+				std::cout << "match: bad option " << arg << "\n";
+				printUsage();
+				return 1;
 			}
 		}
 
-		return maxValue;
-	}
+		// A bad line of an openings file is skipped, playGame only gets openings that set up.
+		std::vector<std::string> openings;
+		for (const auto& opening : settings.openings) {
+			g_chess::Board bd;
+			g_chess::Side side{};
+			if (setupOpening(opening, bd, side)) {
+				openings.push_back(opening);
+			}
+			else {
+				std::cout << "match: skipping bad opening " << opening << "\n";
+			}
+		}
 
-	template<Side S>
-	Move genBestMoveFor(Board& bd, uint32_t searchDepth);
+		if (openings.empty()) {
+			std::cout << "match: no valid opening\n";
+			return 1;
+		}
+		settings.openings.swap(openings);
+
+		const double lower = std::log(settings.beta / (1 - settings.alpha));
+		const double upper = std::log((1 - settings.beta) / settings.alpha);
+		std::atomic<uint32_t> nextGame{ 0 };
+		std::atomic<bool> decided{ false };
+		std::mutex mutex;
+		uint32_t wins = 0, draws = 0, losses = 0;
+		std::vector<std::thread> threads;
+
+		std::cout << "match: " << settings.games << " games, SPRT elo0 " << settings.elo0 << " elo1 " << settings.elo1
+			<< " bounds [" << lower << ", " << upper << "]\n";
+
+		for (uint32_t t = 0; t < std::min(settings.threadNum, settings.games); ++t) {
+			threads.emplace_back([&]() {
+				std::array<g_chess::TransTable, 2> tts;
+				tts[0].resize(settings.hashMb);
+				tts[1].resize(settings.hashMb);
+
+				for (uint32_t game = nextGame++; game < settings.games && !decided; game = nextGame++) {
+					const std::string& opening = settings.openings[(game / 2) % settings.openings.size()];
+					const bool aIsDown = game % 2 == 0;
+					GameResult result = playGame(settings, opening, aIsDown, tts);
+
+					std::lock_guard<std::mutex> lock{ mutex };
+					if (decided) {
+						break;
+					}
 
-	template<>
-	Move genBestMoveFor<Side::UP>(Board& bd, uint32_t searchDepth) {
-		Move bestMove{};
-		Moves moves;
-		genMoves<Side::UP>(bd, moves);
+					(result.halfPoints == 2 ? wins : result.halfPoints == 1 ? draws : losses) += 1;
+					const uint32_t played = wins + draws + losses;
+					const double ratio = llr(wins, draws, losses, settings.elo0, settings.elo1);
 
-		bool stopFlag = false;
-		auto task = std::async(std::launch::async, [&moves, &bd, &bestMove, &stopFlag, searchDepth]() {
-			int32_t minValue = MAX_VALUE;
-			int32_t value{};
+					std::cout << "game " << game + 1 << " A " << (aIsDown ? "red" : "black") << " " << (result.halfPoints == 2 ? "win" : result.halfPoints == 1 ? "draw" : "loss")
+						<< " (" << result.reason << "), W " << wins << " D " << draws << " L " << losses
+						<< " elo " << std::fixed << std::setprecision(1) << eloOfScore((wins + 0.5 * draws) / played)
+						<< " LLR " << std::setprecision(2) << ratio << std::defaultfloat << std::setprecision(6) << std::endl;
 
-			for (const auto& m : moves) {
-				if (stopFlag) {
-					break;
+					if (ratio >= upper || ratio <= lower) {
+						decided = true;
+						std::cout << "SPRT: " << (ratio >= upper ? "H1 accepted, A is stronger by elo1 or more" : "H0 accepted, A isn't stronger by elo1") << std::endl;
+					}
 				}
+			});
+		}
 
-				bd.move(m);
-				value = minMax<Side::DOWN>(bd, searchDepth, MIN_VALUE, MAX_VALUE, stopFlag);
-				bd.undo();
+		for (auto& th : threads) {
+			th.join();
+		}
+
+		if (!decided) {
+			std::cout << "SPRT: undecided after " << wins + draws + losses << " games\n";
+		}
+
+		return 0;
+	}
+};
+
+/*
+	Opening book builder, run as "gchess book <games file> <book file> [maxply=30]". The games are either PGN with ICCS
+	moves, "1. H2-E2 H9-G7 2. ...", or plain move lists with one game per line, "h2e2 h9g7 ...". Tags, move numbers,
+	comments in braces and results are skipped, and a PGN game ends at its result or at the next tag. The first
+	maxply moves of every game go into the book, up to the first illegal one, weighted by the number of games that
+	played the move in that position.
+*/
+namespace book {
+	constexpr uint32_t MAX_WEIGHT = 0xFFFF;
+
+	// "H2-E2", "h2e2" and "12.h2e2" all give h2e2.
+	bool parseMove(std::string token, g_chess::Move& m) {
+		token.erase(0, token.find_first_not_of("0123456789."));
+		token.erase(std::remove(token.begin(), token.end(), '-'), token.end());
+		std::transform(token.begin(), token.end(), token.begin(), [](char c) { return static_cast<char>(std::tolower(static_cast<unsigned char>(c))); });
+
+		if (!isInputValid(token)) {
+			return false;
+		}
+
+		m = inputToMove(token);
+		return true;
+	}
+
+	void addGame(const std::vector<g_chess::Move>& moves, uint32_t maxPly, std::vector<g_chess::BookEntry>& entries) {
+		using namespace g_chess;
+		Board bd;
+		Side side = Side::DOWN;
+
+		for (size_t ply = 0; ply < moves.size() && ply < maxPly; ++ply) {
+			const Move& m = moves[ply];
+			if (p_util::getSide(bd.get(m.from())) != side || !isValidMove(bd, m)) {
+				break;
+			}
+
+			entries.push_back(BookEntry{ bd.getKey(), m.data, 1, 0 });
+			bd.move(m);
+			side = p_util::getReverseSide(side);
+		}
+	}
+
+	int run(const std::string& gamesFile, const std::string& bookFile, uint32_t maxPly) {
+		using namespace g_chess;
+		std::ifstream in{ gamesFile };
+		std::string line, token;
+		std::vector<BookEntry> entries;
+		std::vector<Move> moves;
+		bool pgn = false, inComment = false;
+		size_t games = 0;
+
+		if (!in) {
+			std::cout << "book: can't open " << gamesFile << "\n";
+			return 1;
+		}
+
+		auto endGame = [&]() {
+			if (!moves.empty()) {
+				addGame(moves, maxPly, entries);
+				moves.clear();
+				++games;
+			}
+		};
+
+		while (std::getline(in, line)) {
+			if (!line.empty() && line[0] == '[') {
+				endGame();
+				pgn = true;
+				continue;
+			}
+
+			std::istringstream tokens{ line };
+			while (tokens >> token) {
+				if (inComment || token[0] == '{') {
+					inComment = token.find('}') == std::string::npos;
+					continue;
+				}
 
-				if (minValue >= value) {
-					minValue = value;
-					bestMove = m;
+				Move m;
+				if (token == "1-0" || token == "0-1" || token == "1/2-1/2" || token == "*") {
+					endGame();
+				}
+				else if (parseMove(token, m)) {
+					moves.push_back(m);
 				}
 			}
-			});
-		
-		auto status = task.wait_for(std::chrono::seconds(5));
-		if (status == std::future_status::timeout) {
-			stopFlag = true;
+
+			if (!pgn) {
+				endGame();
+			}
+		}
+		endGame();
+
+		// Merge the entries of the same move in the same position, the weight is the number of games.
+		std::sort(entries.begin(), entries.end(), [](const BookEntry& a, const BookEntry& b) {
+			return a.key != b.key ? a.key < b.key : a.move < b.move;
+		});
+
+		std::vector<BookEntry> merged;
+		size_t positions = 0;
+		for (const auto& e : entries) {
+			if (!merged.empty() && merged.back().key == e.key && merged.back().move == e.move) {
+				merged.back().weight = static_cast<uint16_t>(std::min<uint32_t>(merged.back().weight + 1u, MAX_WEIGHT));
+			}
+			else {
+				positions += merged.empty() || merged.back().key != e.key;
+				merged.push_back(e);
+			}
+		}
+
+		if (!OpeningBook::write(bookFile, merged)) {
+			std::cout << "book: can't write " << bookFile << "\n";
+			return 1;
 		}
 
-		task.get();
-		return bestMove;
+		std::cout << "book: " << games << " games, " << positions << " positions, " << merged.size() << " moves written to " << bookFile << "\n";
+		return 0;
 	}
+};
 
-	template<>
-	Move genBestMoveFor<Side::DOWN>(Board& bd, uint32_t searchDepth) {
-		Move bestMove{};
-		int32_t maxValue = MIN_VALUE;
-		int32_t value{};
-		bool stopFlag = false;
+/*
+	Regression checks of what bench doesn't cover, run as "gchess selftest". Every failed check is printed, and the
+	exit code is non-zero when any failed.
+*/
+namespace selftest {
+	bool check(bool ok, const std::string& what) {
+		if (!ok) {
+			std::cout << "selftest: FAILED " << what << "\n";
+		}
+		return ok;
+	}
+
+	// A FEN without legal material must be refused by setFen and reported by the batch analyser, not loaded.
+	bool checkFens() {
+		using namespace g_chess;
+		const char* const goodFens[] = {
+			"rnbakabnr/9/1c5c1/p1p1p1p1p/9/9/P1P1P1P1P/1C5C1/9/RNBAKABNR w - - 0 1",
+			"3k5/4a4/5a3/9/9/9/9/9/1R7/4K4 w",
+			"5k3/9/9/9/9/9/9/9/9/3K5 b",
+		};
+		const char* const badFens[] = {
+			"RRRRRRRRR/RRRRRRRRR/4k4/9/9/9/9/9/9/4K4 w",
+			"R3k4/1R7/2R6/3R5/4R4/5R3/6R2/7R1/8R/R2K1RRRR w",
+			"4k4/9/9/9/9/PPPPPP3/9/9/9/4K4 w",
+			"4k4/9/9/9/9/9/9/9/9/9 w",
+			"4k4/9/9/9/9/9/9/9/9/3KK4 w",
+			"9/9/9/4k4/9/9/9/9/9/4K4 w",
+			"4k4/9/9/9/9/9/9/9/9/6K2 w",
+		};
+		bool ok = true;
+		Board bd;
+		Side side{};
+
+		for (const char* fenStr : goodFens) {
+			ok &= check(setFen(bd, fenStr, side), std::string{ "accepts " } + fenStr);
+		}
+		for (const char* fenStr : badFens) {
+			ok &= check(!setFen(bd, fenStr, side), std::string{ "rejects " } + fenStr);
+		}
+
+		TransTable tt{ 1 };
+		SearchLimits limits;
+		limits.maxDepth = 2;
+		uint64_t nodes = 0;
+		const std::string overFull = badFens[0];
+		ok &= check(batch::analyse(bd, tt, overFull, limits, SearchConfig{}, nodes) == overFull + "\terror bad fen", "batch reports " + overFull);
+
+		return ok;
+	}
+
+	// Both piece lists in slot order, the order the move generator walks them in.
+	std::vector<uint32_t> pieceListsOf(const g_chess::Board& bd) {
+		std::vector<uint32_t> lists;
+
+		for (g_chess::Side side : { g_chess::Side::UP, g_chess::Side::DOWN }) {
+			lists.push_back(bd.getPieceCount(side));
+			for (uint32_t i = 0; i < bd.getPieceCount(side); ++i) {
+				lists.push_back(bd.getPieceSquare(side, i));
+			}
+		}
 
+		return lists;
+	}
+
+	// Every move followed by its undo, to depth, must give back the piece lists, the key and the score it started from.
+	template<g_chess::Side side>
+	bool checkRoundTrips(g_chess::Board& bd, uint32_t depth) {
+		using namespace g_chess;
+		const std::vector<uint32_t> lists = pieceListsOf(bd);
+		const uint64_t key = bd.getKey();
+		const int32_t score = bd.getScore();
 		Moves moves;
-		genMoves<Side::DOWN>(bd, moves);
+		genLegalMoves<side>(bd, moves);
 
 		for (const auto& m : moves) {
 			bd.move(m);
-			value = minMax<Side::UP>(bd, searchDepth, MIN_VALUE, MAX_VALUE, stopFlag);
+			bool ok = depth <= 1 || checkRoundTrips<p_util::getReverseSide(side)>(bd, depth - 1);
 			bd.undo();
 
-			if (maxValue <= value) {
-				maxValue = value;
-				bestMove = m;
+			if (!ok || pieceListsOf(bd) != lists || bd.getKey() != key || bd.getScore() != score) {
+				return false;
 			}
 		}
 
-		return bestMove;
+		return true;
 	}
-};
 
-bool isInputValid(const std::string& input) {
-	std::regex reg{ R"([a-i][0-9][a-i][0-9])" };
-	return std::regex_match(input, reg);
-}
+	bool checkMakeUnmake() {
+		using namespace g_chess;
+		bool ok = true;
 
-g_chess::Move inputToMove(const std::string& input) {
-	g_chess::Move m{};
-	m.from.row = 9 - static_cast<uint32_t>(input[1] - '0') + g_chess::Board::SINGLE_ROW_PADDING;
-	m.from.col = static_cast<uint32_t>(input[0] - 'a') + g_chess::Board::SINGLE_COL_PADDING;
-	m.to.row = 9 - static_cast<uint32_t>(input[3] - '0') + g_chess::Board::SINGLE_ROW_PADDING;
-	m.to.col = static_cast<uint32_t>(input[2] - 'a') + g_chess::Board::SINGLE_COL_PADDING;
+		for (const auto& position : bench::positions) {
+			Board bd;
+			Side side{};
+			if (!bench::setupPosition(position, bd, side)) {
+				return false;
+			}
 
-	return m;
-}
+			const bool roundTrips = side == Side::UP ? checkRoundTrips<Side::UP>(bd, 3) : checkRoundTrips<Side::DOWN>(bd, 3);
+			ok &= check(roundTrips, std::string{ "make/unmake round trips from " } + position.name);
+		}
 
-std::string moveToStr(const g_chess::Move& m) {
-	std::string str;
-	str += (m.from.col - g_chess::Board::SINGLE_COL_PADDING + 'a');
-	str += (9 - (m.from.row - g_chess::Board::SINGLE_ROW_PADDING) + '0');
-	str += (m.to.col - g_chess::Board::SINGLE_COL_PADDING + 'a');
-	str += (9 - (m.to.row - g_chess::Board::SINGLE_ROW_PADDING) + '0');
+		return ok;
+	}
 
-	return str;
+	/*
+		The search must finish at any setting of its switches. A reduction below depth 0 used to wrap around and search
+		until MAX_PLY, so a low lmrMinDepth never completed an iteration. The node cap keeps a regression from hanging.
+	*/
+	bool checkSearchConfigs() {
+		using namespace g_chess;
+		bool ok = true;
+
+		for (uint32_t lmrMinDepth = 0; lmrMinDepth <= 3; ++lmrMinDepth) {
+			Board bd;
+			TransTable tt{ 1 };
+			SearchLimits limits;
+			limits.maxDepth = 5;
+			limits.maxNodes = 2000000;
+			SearchConfig config;
+			config.lmrMinDepth = lmrMinDepth;
+			config.lmrMinMoveIndex = 0;
+
+			SearchResult result = searchBestMove<Side::DOWN>(bd, tt, limits, 1, config);
+			ok &= check(result.depth == limits.maxDepth, "depth 5 search with lmrmindepth " + std::to_string(lmrMinDepth) + " and lmrmoves 0");
+		}
+
+		return ok;
+	}
+
+	// The SPRT of the match runner must be able to stop on one-sided results.
+	bool checkLlr() {
+		const double lower = std::log(0.05 / 0.95), upper = std::log(0.95 / 0.05);
+		bool ok = true;
+
+		ok &= check(match::llr(30, 10, 0, 0, 10) >= upper, "llr accepts H1 after 30 wins, 10 draws and no loss");
+		ok &= check(match::llr(0, 10, 30, 0, 10) <= lower, "llr accepts H0 after no win, 10 draws and 30 losses");
+		ok &= check(match::llr(0, 40, 0, 0, 10) < 0, "llr leans to H0 after 40 draws");
+		ok &= check(std::abs(match::llr(1, 0, 1, 0, 10)) < 1, "llr stays near 0 after a win and a loss");
+
+		return ok;
+	}
+
+	int run() {
+		bool ok = checkFens();
+		ok &= checkMakeUnmake();
+		ok &= checkSearchConfigs();
+		ok &= checkLlr();
+		std::cout << "selftest: " << (ok ? "all checks passed" : "FAILED") << "\n";
+		return ok ? 0 : 1;
+	}
+};
+
+// An optional numeric argument of a mode, value keeps its default when there is no argument i.
+template<typename T>
+bool numberArg(const std::vector<std::string>& args, size_t i, T& value) {
+	if (i < args.size() && !parseNumber(args[i], value)) {
+		std::cout << "Bad number " << args[i] << "\n";
+		printUsage();
+		return false;
+	}
+	return true;
 }
 
-g_chess::Side checkWinner(const g_chess::Board& bd) {
+int main(int argc, char* argv[]) {
 	using namespace g_chess;
 
-	bool upAlive = false;
-	bool downAlive = false;
-	Piece p{};
+	std::vector<std::string> args{ argv + 1, argv + argc };
+	nnue::Network network;
+	const nnue::Network* activeNetwork = nullptr;
 
-	for (uint32_t r = Board::LINE_UP_9_TOP; r <= Board::LINE_UP_9_BOTTOM; ++r) {
-		for (uint32_t c = Board::LINE_UP_9_LEFT; c <= Board::LINE_UP_9_RIGHT; ++c) {
-			p = bd.get(r, c);
-			if (p == Piece::UG) {
-				upAlive = true;
-			}
+	// "--nnue <file>" evaluates with a network instead of the piece-square tables, in any mode.
+	auto nnueArg = std::find(args.begin(), args.end(), "--nnue");
+	if (nnueArg != args.end()) {
+		if (nnueArg + 1 == args.end() || !network.load(*(nnueArg + 1))) {
+			std::cout << "Can't load the network file\n";
+			return 1;
 		}
+
+		std::cout << "NNUE evaluation, " << nnue::kernel::levelName(nnue::kernel::kernels.level) << " kernels\n";
+		activeNetwork = &network;
+		args.erase(nnueArg, nnueArg + 2);
 	}
 
-	for (uint32_t r = Board::LINE_DOWN_9_TOP; r <= Board::LINE_DOWN_9_BOTTOM; ++r) {
-		for (uint32_t c = Board::LINE_DOWN_9_LEFT; c <= Board::LINE_DOWN_9_RIGHT; ++c) {
-			p = bd.get(r, c);
-			if (p == Piece::DG) {
-				downAlive = true;
-			}
+	// "--book <file>" answers the positions an opening book knows without searching, in the game, UCCI and match modes.
+	OpeningBook book;
+	const OpeningBook* activeBook = nullptr;
+	auto bookArg = std::find(args.begin(), args.end(), "--book");
+	if (bookArg != args.end()) {
+		if (bookArg + 1 == args.end() || !book.open(*(bookArg + 1))) {
+			std::cout << "Can't open the book file\n";
+			return 1;
 		}
+
+		activeBook = &book;
+		args.erase(bookArg, bookArg + 2);
 	}
 
-	if (upAlive && downAlive) {
-		return Side::EXTRA;
+	// "--tb <dir>" probes the endgame tables of a directory in the search, in the game, UCCI, batch and match modes.
+	tablebase::Tablebases tablebases;
+	const tablebase::Tablebases* activeTablebases = nullptr;
+	auto tbArg = std::find(args.begin(), args.end(), "--tb");
+	if (tbArg != args.end()) {
+		if (tbArg + 1 == args.end() || tablebases.load(*(tbArg + 1)) == 0) {
+			std::cout << "Can't find endgame tables\n";
+			return 1;
+		}
+
+		std::cout << "Endgame tables up to " << tablebases.getMaxPieces() << " pieces\n";
+		activeTablebases = &tablebases;
+		args.erase(tbArg, tbArg + 2);
 	}
-	else if (upAlive) {
-		return Side::UP;
+
+	// "--stats <file>" appends the statistics of every search to a file, see namespace stats.
+	stats::Log statsLog;
+	stats::Log* activeStatsLog = nullptr;
+	auto statsArg = std::find(args.begin(), args.end(), "--stats");
+	if (statsArg != args.end()) {
+		if (!STATS_ENABLED) {
+			std::cout << "Search statistics need an engine compiled with -DGCHESS_STATS\n";
+			return 1;
+		}
+		if (statsArg + 1 == args.end() || !statsLog.open(*(statsArg + 1))) {
+			std::cout << "Can't open the statistics file\n";
+			return 1;
+		}
+
+		activeStatsLog = &statsLog;
+		args.erase(statsArg, statsArg + 2);
 	}
-	else {
-		return Side::DOWN;
+
+	if (!args.empty() && (args[0] == "help" || args[0] == "--help" || args[0] == "-h")) {
+		printUsage();
+		return 0;
+	}
+
+	if (!args.empty() && args[0] == "bench") {
+		uint32_t perftDepth = bench::KNOWN_PERFT_DEPTH, searchDepth = 6;
+		if (!numberArg(args, 1, perftDepth) || !numberArg(args, 2, searchDepth)) {
+			return 1;
+		}
+		return bench::run(perftDepth, searchDepth, activeNetwork, activeStatsLog);
+	}
+
+	if (!args.empty() && args[0] == "selftest") {
+		return selftest::run();
+	}
+
+	if (args.size() > 2 && args[0] == "book") {
+		uint32_t maxPly = 30;
+		if (!numberArg(args, 3, maxPly)) {
+			return 1;
+		}
+		return book::run(args[1], args[2], maxPly);
+	}
+
+	if (args.size() > 2 && args[0] == "batch") {
+		uint32_t depth = 8, threadNum = std::max(1u, std::thread::hardware_concurrency());
+		uint64_t maxNodes = 0;
+		if (!numberArg(args, 3, depth) || !numberArg(args, 4, maxNodes) || !numberArg(args, 5, threadNum)) {
+			return 1;
+		}
+		return batch::run(args[1], args[2], depth, maxNodes, threadNum, activeNetwork, activeTablebases, activeStatsLog);
+	}
+
+	if (!args.empty() && args[0] == "match") {
+		return match::run(std::vector<std::string>{ args.begin() + 1, args.end() }, activeNetwork, activeBook, activeTablebases, activeStatsLog);
+	}
+
+	if (!args.empty() && args[0] == "ucci") {
+		return ucci::run(activeNetwork, activeBook, activeTablebases, activeStatsLog, false);
+	}
+
+	if (args.size() > 1 && args[0] == "tune") {
+		std::string header = args.size() > 2 ? args[2] : "tuned_values.h";
+		uint32_t epochs = 300, threadNum = std::max(1u, std::thread::hardware_concurrency());
+		if (!numberArg(args, 3, epochs) || !numberArg(args, 4, threadNum)) {
+			return 1;
+		}
+		return tune::run(args[1], header, epochs, std::max(1u, threadNum));
+	}
+
+	if (args.size() > 2 && args[0] == "tbgen") {
+		uint32_t threadNum = std::max(1u, std::thread::hardware_concurrency());
+		tablebase::Generator generator{ args[1], threadNum };
+
+		for (auto it = args.begin() + 2; it != args.end(); ++it) {
+			tablebase::Signature sig;
+			if (!tablebase::Signature::parse(*it, sig)) {
+				std::cout << "tbgen: bad signature " << *it << ", like RvA with at most " << tablebase::MAX_EXTRA_PIECES << " pieces besides the generals\n";
+				return 1;
+			}
+			if (!generator.generate(sig)) {
+				return 1;
+			}
+		}
+		return 0;
 	}
-}
 
-int main() {
-	using namespace g_chess;
 	Board bd;
+	bd.setNetwork(activeNetwork);
+	TransTable tt;
+	SearchLimits limits;
+	limits.moveTime = std::chrono::milliseconds(5000);
+	SearchConfig config;
+	config.tablebases = activeTablebases;
+	if (activeStatsLog != nullptr) {
+		activeStatsLog->attach(config);
+	}
+	uint32_t threadNum = std::max(1u, std::thread::hardware_concurrency());
 	std::string input;
 	Move aiBestMove{};
 
@@ -990,6 +6568,11 @@ int main() {
 		std::cout << "Your move: ";
 		std::getline(std::cin, input);
 
+		// A GUI starting the engine without arguments, UCCI from here on.
+		if (input == "ucci" && bd.getKey() == Board{}.getKey()) {
+			return ucci::run(activeNetwork, activeBook, activeTablebases, activeStatsLog, true);
+		}
+
 		if (input == "undo") {
 			bd.undo();
 			bd.undo();
@@ -1023,18 +6606,19 @@ int main() {
 		bd.move(m);
 		printBoard(bd);
 
-		if (checkWinner(bd) == Side::DOWN) {
+		// Without a legal move, checkmated or stalemated, a side has lost.
+		if (checkWinner(bd) == Side::DOWN || !hasLegalMove<Side::UP>(bd)) {
 			std::cout << "You win!\n";
 			break;
 		}
 
 		std::cout << "AI thinking...\n";
-		aiBestMove = genBestMoveFor<Side::UP>(bd, 5);
-		char c = p_util::getChar(bd.get(aiBestMove.from));
+		aiBestMove = genBestMoveFor<Side::UP>(bd, tt, limits, threadNum, config, activeBook);
+		char c = p_util::getChar(bd.get(aiBestMove.from()));
 		std::cout << "AI moves: " << moveToStr(aiBestMove) << " -> " << c << "\n";
 		bd.move(aiBestMove);
 
-		if (checkWinner(bd) == Side::UP) {
+		if (checkWinner(bd) == Side::UP || !hasLegalMove<Side::DOWN>(bd)) {
 			printBoard(bd);
 			std::cout << "You lose!\n";
 			break;